@@ -161,10 +161,9 @@ typedef struct {
     Slvs_hParam         dragged[4];
 
     /* If the solver fails, then it can determine which constraints are
-     * causing the problem. But this is a relatively slow process (for
-     * a system with n constraints, about n times as long as just solving).
-     * If calculateFaileds is true, then the solver will do so, otherwise
-     * not. */
+     * causing the problem. This costs about one more factorization of
+     * the whole system, on top of solving. If calculateFaileds is true,
+     * then the solver will do so, otherwise not. */
     int                 calculateFaileds;
 
     /*** OUTPUT VARIABLES
@@ -188,12 +187,103 @@ typedef struct {
 #define SLVS_RESULT_OKAY                0
 #define SLVS_RESULT_INCONSISTENT        1
 #define SLVS_RESULT_DIDNT_CONVERGE      2
+/* No longer returned; the number of unknowns is unlimited. */
 #define SLVS_RESULT_TOO_MANY_UNKNOWNS   3
+/* The system couldn't be loaded, since it has an entity or constraint of a
+ * type that we don't know, two of anything with the same handle, or a param
+ * with a handle from 0xc0000000 up, which are reserved. */
+#define SLVS_RESULT_INVALID             4
     int                 result;
+
+    /*** MORE INPUT VARIABLES
+     *
+     * These come last, so that the members above stay where they were.
+     *
+     * How the solver takes its steps. By default it takes each Newton step
+     * in full, which is fastest when the initial guess is good. Damped
+     * steps (Levenberg-Marquardt) are taken only when they reduce the
+     * residual, so this converges more often when the initial guess is far
+     * from the solution, at the cost of some extra iterations. */
+#define SLVS_SOLVE_NEWTON               0
+#define SLVS_SOLVE_DAMPED               1
+    int                 solveMethod;
 } Slvs_System;
 
 DLL void Slvs_Solve(Slvs_System *sys, Slvs_hGroup hg);
 
+/* Slvs_Solve() keeps its state in globals, so it mustn't be called from
+ * more than one thread at once. Instead, each thread can create a context
+ * of its own, and solve within that; contexts share no state, so any number
+ * of them can be solving at once, as long as each is used by only one
+ * thread at a time. Slvs_Solve() just solves within a default context. */
+typedef struct Slvs_Context Slvs_Context;
+
+DLL Slvs_Context *Slvs_CreateContext(void);
+DLL void Slvs_DestroyContext(Slvs_Context *ctx);
+DLL void Slvs_SolveInContext(Slvs_Context *ctx, Slvs_System *sys,
+                             Slvs_hGroup hg);
+
+/* A context can also keep a system loaded between solves, so that a program
+ * that solves it over and over, as while dragging, needn't pass the whole
+ * system in each time. Load it with Slvs_LoadSystem(); then change the
+ * values of its params, or add and remove constraints, and solve again with
+ * Slvs_SolveLoaded(). Any handle passed in must be loaded already, except
+ * that of a constraint to add, which mustn't be.
+ *
+ * Slvs_SolveLoaded() takes the dragged params and other options from sys,
+ * and writes the results to it as Slvs_SolveInContext() would. The
+ * entities and constraints of sys are ignored; but if it has params, then
+ * their solved values are written back to it, and they must be loaded.
+ * The values of any param can also be read with Slvs_GetParamValue().
+ *
+ * Each of these returns SLVS_RESULT_OKAY, or SLVS_RESULT_INVALID if its
+ * arguments break those rules, or there's no system loaded, or the system
+ * or constraint given is one that Slvs_Solve() would call invalid; and
+ * then it changes nothing, except that Slvs_LoadSystem() discards what was
+ * loaded, and Slvs_SolveLoaded() sets the result in sys.
+ *
+ * Slvs_SolveInContext() discards any system loaded in the context. */
+DLL int Slvs_LoadSystem(Slvs_Context *ctx, const Slvs_System *sys);
+DLL int Slvs_SetParamValue(Slvs_Context *ctx, Slvs_hParam hp, double val);
+DLL int Slvs_GetParamValue(Slvs_Context *ctx, Slvs_hParam hp, double *val);
+DLL int Slvs_AddConstraint(Slvs_Context *ctx, const Slvs_Constraint *c);
+DLL int Slvs_RemoveConstraint(Slvs_Context *ctx, Slvs_hConstraint hc);
+DLL int Slvs_SolveLoaded(Slvs_Context *ctx, Slvs_System *sys,
+                         Slvs_hGroup hg);
+
+/* To solve the same system many times over with different values, as for
+ * a parameter sweep, describe each variant of it with an Slvs_Variant, and
+ * solve them all at once with Slvs_SolveVariants(). The system is read just
+ * once, and its equations are compiled just once, since only the values
+ * change from one variant to the next. */
+typedef struct {
+    /*** INPUT VARIABLES
+     *
+     * The value of each param, in the same order as sys->param[], to start
+     * solving this variant from; on output, the solved values. This is
+     * required. */
+    double              *val;
+    /* The valA of each constraint, in the same order as sys->constraint[];
+     * or NULL to keep the valA of each as given in the system. */
+    double              *valA;
+
+    /*** OUTPUT VARIABLES
+     *
+     * These are just as for the whole system; failed[] is optional. */
+    Slvs_hConstraint    *failed;
+    int                 faileds;
+
+    int                 dof;
+
+    int                 result;
+} Slvs_Variant;
+
+/* Solves group hg of the system once for each of the variants; the values
+ * in the system itself are left unchanged. This uses contexts of its own,
+ * up to threads of them, each solving variants on a separate thread. */
+DLL void Slvs_SolveVariants(Slvs_System *sys, Slvs_hGroup hg,
+                            Slvs_Variant *variant, int variants, int threads);
+
 
 /* Our base coordinate system has basis vectors
  *     (1, 0, 0)  (0, 1, 0)  (0, 0, 1)
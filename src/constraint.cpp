@@ -550,7 +550,7 @@ void Constraint::MenuConstrain(Command id) {
                 Constraint *c = SK.GetConstraint(gs.constraint[0]);
                 if(c->HasLabel() && c->type != Type::COMMENT) {
                     (c->reference) = !(c->reference);
-                    SS.MarkGroupDirty(c->group, /*onlyThis=*/true);
+                    SS.MarkGroupDirty(c->group);
                     break;
                 }
             }
@@ -209,7 +209,7 @@ void ConstraintBase::GenerateEquations(IdList<Equation,hEquation> *l,
                                        bool forReference) const {
     if(reference && !forReference) return;
 
-    Expr *exA = Expr::From(valA);
+    Expr *exA = (valP.v != 0) ? Expr::From(valP) : Expr::From(valA);
     switch(type) {
         case Type::PT_PT_DISTANCE:
             AddEq(l, Distance(workplane, ptA, ptB)->Minus(exA), 0);
@@ -627,7 +627,7 @@ void ConstraintBase::GenerateEquations(IdList<Equation,hEquation> *l,
                 // specified angle
                 Expr *rads = exA->Times(Expr::From(PI/180)),
                      *rc   = rads->Cos();
-                double arc = fabs(rc->Eval());
+                double arc = fabs(cos(valA*PI/180));
                 // avoid false detection of inconsistent systems by gaining
                 // up as the difference in dot products gets small at small
                 // angles; doubles still have plenty of precision, only
@@ -308,7 +308,15 @@ public:
         if(n >= elemsAllocated) {
             ReserveMore((elemsAllocated + 32)*2 - n);
         }
-    
+
+        // Handles are most often assigned in increasing order, so check the
+        // end before searching.
+        if(n == 0 || elem[n - 1].h.v < t->h.v) {
+            new(&elem[n]) T(*t);
+            n++;
+            return;
+        }
+
         int first = 0, last = n;
         // We know that we must insert within the closed interval [first,last]
         while(first != last) {
@@ -329,6 +337,42 @@ public:
         n++;
     }
 
+    // Add an item at the end, without keeping the list sorted, to add many
+    // at once; SortAppended() must be called after, before anything else.
+    void Append(T *t) {
+        if(n >= elemsAllocated) {
+            ReserveMore((elemsAllocated + 32)*2 - n);
+        }
+        new(&elem[n]) T(*t);
+        n++;
+    }
+
+    // Sort the items that were appended in to place. Returns false if any
+    // two have the same handle, in which case just the first added is kept.
+    bool SortAppended() {
+        auto less = [](const T &a, const T &b) { return a.h.v < b.h.v; };
+        if(!std::is_sorted(elem, elem + n, less)) {
+            std::stable_sort(elem, elem + n, less);
+        }
+
+        int src, dest = 0;
+        for(src = 0; src < n; src++) {
+            if(dest > 0 && elem[src].h.v == elem[dest - 1].h.v) {
+                elem[src].Clear();
+                continue;
+            }
+            if(src != dest) {
+                elem[dest] = std::move(elem[src]);
+            }
+            dest++;
+        }
+        for(int i = dest; i < n; i++)
+            elem[i].~T();
+        bool unique = (dest == n);
+        n = dest;
+        return unique;
+    }
+
     T *FindById(H h) {
         T *t = FindByIdNoOops(h);
         ssassert(t != NULL, "Cannot find handle");
@@ -351,6 +395,21 @@ public:
         return -1;
     }
 
+    // The index of the first item whose handle is no less than h, or n if
+    // there's none.
+    int LowerBound(H h) {
+        int first = 0, last = n;
+        while(first != last) {
+            int mid = (first + last)/2;
+            if(elem[mid].h.v < h.v) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+        return first;
+    }
+
     T *FindByIdNoOops(H h) {
         int first = 0, last = n-1;
         while(first <= last) {
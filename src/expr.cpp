@@ -211,11 +211,89 @@ Expr *ExprQuaternion::Magnitude() const {
 }
 
 
+//-----------------------------------------------------------------------------
+// The table of shared nodes. Every node is built through Build(), so if a
+// table is active then we never end up with two identical nodes.
+//-----------------------------------------------------------------------------
+thread_local ExprTable *ExprTable::active = NULL;
+
+size_t ExprTable::Hash::operator()(const Expr *e) const {
+    size_t h = std::hash<uint32_t>()((uint32_t)e->op);
+    auto combine = [&](size_t v) {
+        h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+    };
+    switch(e->Children()) {
+        case 0:
+            if(e->op == Expr::Op::CONSTANT) {
+                combine(std::hash<double>()(e->v));
+            } else if(e->op == Expr::Op::PARAM) {
+                combine(std::hash<uint32_t>()(e->parh.v));
+            } else if(e->op == Expr::Op::PARAM_PTR) {
+                combine(std::hash<const void *>()(e->parp));
+            }
+            break;
+
+        case 2:
+            combine(std::hash<const void *>()(e->b));
+            // fall through
+        case 1:
+            combine(std::hash<const void *>()(e->a));
+            break;
+    }
+    return h;
+}
+
+bool ExprTable::Equal::operator()(const Expr *ea, const Expr *eb) const {
+    if(ea->op != eb->op) return false;
+    switch(ea->op) {
+        case Expr::Op::PARAM:       return ea->parh.v == eb->parh.v;
+        case Expr::Op::PARAM_PTR:   return ea->parp == eb->parp;
+        // Bitwise, so that we don't merge 0 and -0, or fail to merge NaNs.
+        case Expr::Op::CONSTANT:    return memcmp(&ea->v, &eb->v, sizeof(double)) == 0;
+        case Expr::Op::VARIABLE:    return false;
+
+        default:
+            if(ea->a != eb->a) return false;
+            return ea->Children() < 2 || ea->b == eb->b;
+    }
+}
+
+ExprTable::Scope::Scope(ExprTable *t) : table(t), previous(active) {
+    active = table;
+}
+
+ExprTable::Scope::~Scope() {
+    table->Clear();
+    active = previous;
+}
+
+Expr *ExprTable::Intern(const Expr &e) {
+    auto it = nodes.find(const_cast<Expr *>(&e));
+    if(it != nodes.end()) return *it;
+
+    Expr *n = Expr::AllocExpr();
+    *n = e;
+    nodes.insert(n);
+    return n;
+}
+
+void ExprTable::Clear() {
+    nodes.clear();
+}
+
+static Expr *Build(const Expr &e) {
+    if(ExprTable::active) return ExprTable::active->Intern(e);
+
+    Expr *n = Expr::AllocExpr();
+    *n = e;
+    return n;
+}
+
 Expr *Expr::From(hParam p) {
-    Expr *r = AllocExpr();
-    r->op = Op::PARAM;
-    r->parh = p;
-    return r;
+    Expr r;
+    r.op = Op::PARAM;
+    r.parh = p;
+    return Build(r);
 }
 
 Expr *Expr::From(double v) {
@@ -248,18 +326,15 @@ Expr *Expr::From(double v) {
         return &mhalf;
     }
 
-    Expr *r = AllocExpr();
-    r->op = Op::CONSTANT;
-    r->v = v;
-    return r;
+    return Build(Expr(v));
 }
 
 Expr *Expr::AnyOp(Op newOp, Expr *b) {
-    Expr *r = AllocExpr();
-    r->op = newOp;
-    r->a = this;
-    r->b = b;
-    return r;
+    Expr r;
+    r.op = newOp;
+    r.a = this;
+    r.b = b;
+    return Build(r);
 }
 
 int Expr::Children() const {
@@ -298,39 +373,35 @@ int Expr::Nodes() const {
 }
 
 Expr *Expr::DeepCopy() const {
-    Expr *n = AllocExpr();
-    *n = *this;
-    int c = n->Children();
-    if(c > 0) n->a = a->DeepCopy();
-    if(c > 1) n->b = b->DeepCopy();
-    return n;
+    Expr n = *this;
+    int c = n.Children();
+    if(c > 0) n.a = a->DeepCopy();
+    if(c > 1) n.b = b->DeepCopy();
+    return Build(n);
 }
 
 Expr *Expr::DeepCopyWithParamsAsPointers(IdList<Param,hParam> *firstTry,
-    IdList<Param,hParam> *thenTry) const
+    IdList<Param,hParam> *thenTry, IdList<Param,hParam> *lastTry) const
 {
-    Expr *n = AllocExpr();
+    Expr n;
     if(op == Op::PARAM) {
         // A param that is referenced by its hParam gets rewritten to go
-        // straight in to the parameter table with a pointer, or simply
-        // into a constant if it's already known.
+        // straight in to the parameter table with a pointer. That's so even
+        // if it's known, since then what we compile from the copy doesn't
+        // depend on its value, and stays good when that changes.
         Param *p = firstTry->FindByIdNoOops(parh);
-        if(!p) p = thenTry->FindById(parh);
-        if(p->known) {
-            n->op = Op::CONSTANT;
-            n->v = p->val;
-        } else {
-            n->op = Op::PARAM_PTR;
-            n->parp = p;
-        }
-        return n;
+        if(!p) p = thenTry->FindByIdNoOops(parh);
+        if(!p) p = lastTry->FindById(parh);
+        n.op = Op::PARAM_PTR;
+        n.parp = p;
+        return Build(n);
     }
 
-    *n = *this;
-    int c = n->Children();
-    if(c > 0) n->a = a->DeepCopyWithParamsAsPointers(firstTry, thenTry);
-    if(c > 1) n->b = b->DeepCopyWithParamsAsPointers(firstTry, thenTry);
-    return n;
+    n = *this;
+    int c = n.Children();
+    if(c > 0) n.a = a->DeepCopyWithParamsAsPointers(firstTry, thenTry, lastTry);
+    if(c > 1) n.b = b->DeepCopyWithParamsAsPointers(firstTry, thenTry, lastTry);
+    return Build(n);
 }
 
 double Expr::Eval() const {
@@ -411,6 +482,15 @@ uint64_t Expr::ParamsUsed() const {
     return r;
 }
 
+void Expr::ParamsUsedList(std::vector<hParam> *list) const {
+    if(op == Op::PARAM)     list->push_back(parh);
+    if(op == Op::PARAM_PTR) list->push_back(parp->h);
+
+    int c = Children();
+    if(c >= 1)          a->ParamsUsedList(list);
+    if(c >= 2)          b->ParamsUsedList(list);
+}
+
 bool Expr::DependsOn(hParam p) const {
     if(op == Op::PARAM)     return (parh.v    == p.v);
     if(op == Op::PARAM_PTR) return (parp->h.v == p.v);
@@ -425,53 +505,48 @@ bool Expr::Tol(double a, double b) {
     return fabs(a - b) < 0.001;
 }
 Expr *Expr::FoldConstants() {
-    Expr *n = AllocExpr();
-    *n = *this;
+    Expr n = *this;
 
     int c = Children();
-    if(c >= 1) n->a = a->FoldConstants();
-    if(c >= 2) n->b = b->FoldConstants();
+    if(c >= 1) n.a = a->FoldConstants();
+    if(c >= 2) n.b = b->FoldConstants();
 
     switch(op) {
         case Op::PARAM_PTR:
         case Op::PARAM:
         case Op::CONSTANT:
         case Op::VARIABLE:
-            break;
+            return this;
 
         case Op::MINUS:
         case Op::TIMES:
         case Op::DIV:
         case Op::PLUS:
             // If both ops are known, then we can evaluate immediately
-            if(n->a->op == Op::CONSTANT && n->b->op == Op::CONSTANT) {
-                double nv = n->Eval();
-                n->op = Op::CONSTANT;
-                n->v = nv;
-                break;
+            if(n.a->op == Op::CONSTANT && n.b->op == Op::CONSTANT) {
+                return From(n.Eval());
             }
             // x + 0 = 0 + x = x
-            if(op == Op::PLUS && n->b->op == Op::CONSTANT && Tol(n->b->v, 0)) {
-                *n = *(n->a); break;
+            if(op == Op::PLUS && n.b->op == Op::CONSTANT && Tol(n.b->v, 0)) {
+                return n.a;
             }
-            if(op == Op::PLUS && n->a->op == Op::CONSTANT && Tol(n->a->v, 0)) {
-                *n = *(n->b); break;
+            if(op == Op::PLUS && n.a->op == Op::CONSTANT && Tol(n.a->v, 0)) {
+                return n.b;
             }
             // 1*x = x*1 = x
-            if(op == Op::TIMES && n->b->op == Op::CONSTANT && Tol(n->b->v, 1)) {
-                *n = *(n->a); break;
+            if(op == Op::TIMES && n.b->op == Op::CONSTANT && Tol(n.b->v, 1)) {
+                return n.a;
             }
-            if(op == Op::TIMES && n->a->op == Op::CONSTANT && Tol(n->a->v, 1)) {
-                *n = *(n->b); break;
+            if(op == Op::TIMES && n.a->op == Op::CONSTANT && Tol(n.a->v, 1)) {
+                return n.b;
             }
             // 0*x = x*0 = 0
-            if(op == Op::TIMES && n->b->op == Op::CONSTANT && Tol(n->b->v, 0)) {
-                n->op = Op::CONSTANT; n->v = 0; break;
+            if(op == Op::TIMES && n.b->op == Op::CONSTANT && Tol(n.b->v, 0)) {
+                return From(0.0);
             }
-            if(op == Op::TIMES && n->a->op == Op::CONSTANT && Tol(n->a->v, 0)) {
-                n->op = Op::CONSTANT; n->v = 0; break;
+            if(op == Op::TIMES && n.a->op == Op::CONSTANT && Tol(n.a->v, 0)) {
+                return From(0.0);
             }
-
             break;
 
         case Op::SQRT:
@@ -481,25 +556,46 @@ Expr *Expr::FoldConstants() {
         case Op::COS:
         case Op::ASIN:
         case Op::ACOS:
-            if(n->a->op == Op::CONSTANT) {
-                double nv = n->Eval();
-                n->op = Op::CONSTANT;
-                n->v = nv;
+            if(n.a->op == Op::CONSTANT) {
+                return From(n.Eval());
             }
             break;
     }
-    return n;
+    if(n.a == a && (c < 2 || n.b == b)) return this;
+    return Build(n);
 }
 
-void Expr::Substitute(hParam oldh, hParam newh) {
+Expr *Expr::Substitute(hParam oldh, hParam newh) {
     ssassert(op != Op::PARAM_PTR, "Expected an expression that refer to params via handles");
 
     if(op == Op::PARAM && parh.v == oldh.v) {
-        parh = newh;
+        return From(newh);
+    }
+
+    // The nodes may be shared, so build a new expression instead of
+    // changing this one, reusing any subexpressions that don't change.
+    Expr n = *this;
+    int c = Children();
+    if(c >= 1) n.a = a->Substitute(oldh, newh);
+    if(c >= 2) n.b = b->Substitute(oldh, newh);
+    if(c == 0 || (n.a == a && (c < 2 || n.b == b))) return this;
+    return Build(n);
+}
+
+Expr *Expr::Substitute(const std::unordered_map<uint32_t, hParam> &subst) {
+    ssassert(op != Op::PARAM_PTR, "Expected an expression that refer to params via handles");
+
+    if(op == Op::PARAM) {
+        auto it = subst.find(parh.v);
+        return (it == subst.end()) ? this : From(it->second);
     }
+
+    Expr n = *this;
     int c = Children();
-    if(c >= 1) a->Substitute(oldh, newh);
-    if(c >= 2) b->Substitute(oldh, newh);
+    if(c >= 1) n.a = a->Substitute(subst);
+    if(c >= 2) n.b = b->Substitute(subst);
+    if(c == 0 || (n.a == a && (c < 2 || n.b == b))) return this;
+    return Build(n);
 }
 
 //-----------------------------------------------------------------------------
@@ -541,6 +637,228 @@ hParam Expr::ReferencedParams(ParamList *pl) const {
 }
 
 
+//-----------------------------------------------------------------------------
+// Compile expressions to a tape, for faster evaluation. The registers are
+// written in order, so each instruction only refers to registers written by
+// instructions before it, or to params and constants.
+//-----------------------------------------------------------------------------
+void ExprTape::Clear() {
+    code.clear();
+    params.clear();
+    reg.clear();
+    outputs.clear();
+    gradients.clear();
+    gradCode.clear();
+    gradParams.clear();
+    adjoint.clear();
+    regCode.clear();
+    regParam.clear();
+    regMark.clear();
+    mark = 0;
+    exprReg.clear();
+    paramReg.clear();
+}
+
+int ExprTape::AllocRegister(double v) {
+    reg.push_back(v);
+    regCode.push_back(-1);
+    regParam.push_back(-1);
+    return (int)reg.size() - 1;
+}
+
+int ExprTape::Compile(const Expr *e) {
+    int r = CompileExpr(e);
+    outputs.push_back(r);
+    return (int)outputs.size() - 1;
+}
+
+int ExprTape::CompileWithGradient(const Expr *e) {
+    int i = Compile(e);
+
+    // Find everything that this expression depends on; the subexpressions
+    // that it shares with others were compiled earlier, so we can't just
+    // take a contiguous range of the tape.
+    Gradient g;
+    g.output = i;
+    g.code   = (int)gradCode.size();
+    g.params = (int)gradParams.size();
+
+    regMark.resize(reg.size(), 0);
+    mark++;
+    std::vector<int> stack;
+    stack.push_back(outputs[i]);
+    while(!stack.empty()) {
+        int r = stack.back();
+        stack.pop_back();
+        if(regMark[r] == mark) continue;
+        regMark[r] = mark;
+
+        if(regCode[r] >= 0) {
+            const Instruction &in = code[regCode[r]];
+            gradCode.push_back(regCode[r]);
+            stack.push_back(in.a);
+            if(in.b >= 0) stack.push_back(in.b);
+        } else if(regParam[r] >= 0) {
+            gradParams.push_back(regParam[r]);
+        }
+    }
+    g.codeEnd   = (int)gradCode.size();
+    g.paramsEnd = (int)gradParams.size();
+    std::sort(gradCode.begin() + g.code, gradCode.end());
+    std::sort(gradParams.begin() + g.params, gradParams.end());
+    gradients.push_back(g);
+    return i;
+}
+
+int ExprTape::CompileExpr(const Expr *e) {
+    // Subexpressions that appear more than once (as the same node) are
+    // only evaluated once.
+    auto it = exprReg.find(e);
+    if(it != exprReg.end()) return it->second;
+
+    int r = -1;
+    switch(e->op) {
+        case Expr::Op::PARAM:
+        case Expr::Op::PARAM_PTR: {
+            Param *p = (e->op == Expr::Op::PARAM) ? SK.GetParam(e->parh) : e->parp;
+            auto pit = paramReg.find(p);
+            if(pit != paramReg.end()) {
+                r = pit->second;
+            } else {
+                r = AllocRegister();
+                regParam[r] = (int)params.size();
+                params.emplace_back(r, p);
+                paramReg[p] = r;
+            }
+            break;
+        }
+
+        case Expr::Op::CONSTANT:
+            r = AllocRegister(e->v);
+            break;
+
+        case Expr::Op::VARIABLE: ssassert(false, "Not supported yet");
+
+        case Expr::Op::PLUS:
+        case Expr::Op::MINUS:
+        case Expr::Op::TIMES:
+        case Expr::Op::DIV:
+        case Expr::Op::NEGATE:
+        case Expr::Op::SQRT:
+        case Expr::Op::SQUARE:
+        case Expr::Op::SIN:
+        case Expr::Op::COS:
+        case Expr::Op::ASIN:
+        case Expr::Op::ACOS: {
+            Instruction in = {};
+            in.op = e->op;
+            in.a  = CompileExpr(e->a);
+            in.b  = (e->Children() > 1) ? CompileExpr(e->b) : -1;
+            in.dest = r = AllocRegister();
+            regCode[r] = (int)code.size();
+            code.push_back(in);
+            break;
+        }
+    }
+    exprReg[e] = r;
+    return r;
+}
+
+void ExprTape::Eval(double *out) {
+    double *r = reg.data();
+    for(const auto &p : params) {
+        r[p.first] = p.second->val;
+    }
+    for(const Instruction &in : code) {
+        double v = 0.0;
+        switch(in.op) {
+            case Expr::Op::PLUS:    v = r[in.a] + r[in.b]; break;
+            case Expr::Op::MINUS:   v = r[in.a] - r[in.b]; break;
+            case Expr::Op::TIMES:   v = r[in.a] * r[in.b]; break;
+            case Expr::Op::DIV:     v = r[in.a] / r[in.b]; break;
+
+            case Expr::Op::NEGATE:  v = -r[in.a]; break;
+            case Expr::Op::SQRT:    v = sqrt(r[in.a]); break;
+            case Expr::Op::SQUARE:  v = r[in.a] * r[in.a]; break;
+            case Expr::Op::SIN:     v = sin(r[in.a]); break;
+            case Expr::Op::COS:     v = cos(r[in.a]); break;
+            case Expr::Op::ASIN:    v = asin(r[in.a]); break;
+            case Expr::Op::ACOS:    v = acos(r[in.a]); break;
+
+            case Expr::Op::PARAM:
+            case Expr::Op::PARAM_PTR:
+            case Expr::Op::CONSTANT:
+            case Expr::Op::VARIABLE:
+                ssassert(false, "Unexpected operation");
+        }
+        r[in.dest] = v;
+    }
+    if(out == NULL) return;
+    for(size_t i = 0; i < outputs.size(); i++) {
+        out[i] = r[outputs[i]];
+    }
+}
+
+void ExprTape::EvalWithGradient(double *out, double *grad) {
+    Eval(out);
+
+    const double *r = reg.data();
+    adjoint.resize(reg.size());
+    double *adj = adjoint.data();
+    for(const Gradient &g : gradients) {
+        int i;
+        for(i = g.code; i < g.codeEnd; i++) {
+            adj[code[gradCode[i]].dest] = 0.0;
+        }
+        for(i = g.params; i < g.paramsEnd; i++) {
+            adj[params[gradParams[i]].first] = 0.0;
+        }
+        adj[outputs[g.output]] = 1.0;
+
+        // Each instruction only reads registers written before it, so going
+        // backwards we've always got the complete adjoint of its result.
+        // The adjoints of constants get written too, but never read.
+        for(i = g.codeEnd - 1; i >= g.code; i--) {
+            const Instruction &in = code[gradCode[i]];
+            double a = adj[in.dest];
+            if(a == 0.0) continue;
+            switch(in.op) {
+                case Expr::Op::PLUS:    adj[in.a] += a; adj[in.b] += a; break;
+                case Expr::Op::MINUS:   adj[in.a] += a; adj[in.b] -= a; break;
+                case Expr::Op::TIMES:
+                    adj[in.a] += a*r[in.b];
+                    adj[in.b] += a*r[in.a];
+                    break;
+                case Expr::Op::DIV:
+                    adj[in.a] += a/r[in.b];
+                    adj[in.b] -= a*r[in.a]/(r[in.b]*r[in.b]);
+                    break;
+
+                case Expr::Op::NEGATE:  adj[in.a] -= a; break;
+                case Expr::Op::SQRT:    adj[in.a] += a*0.5/r[in.dest]; break;
+                case Expr::Op::SQUARE:  adj[in.a] += a*2.0*r[in.a]; break;
+                case Expr::Op::SIN:     adj[in.a] += a*cos(r[in.a]); break;
+                case Expr::Op::COS:     adj[in.a] -= a*sin(r[in.a]); break;
+                case Expr::Op::ASIN:
+                    adj[in.a] += a/sqrt(1 - r[in.a]*r[in.a]);
+                    break;
+                case Expr::Op::ACOS:
+                    adj[in.a] -= a/sqrt(1 - r[in.a]*r[in.a]);
+                    break;
+
+                case Expr::Op::PARAM:
+                case Expr::Op::PARAM_PTR:
+                case Expr::Op::CONSTANT:
+                case Expr::Op::VARIABLE:
+                    ssassert(false, "Unexpected operation");
+            }
+        }
+        for(i = g.params; i < g.paramsEnd; i++) {
+            grad[i] = adj[params[gradParams[i]].first];
+        }
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Routines to pretty-print an expression. Mostly for debugging.
 //-----------------------------------------------------------------------------
@@ -71,10 +71,13 @@ public:
     Expr *PartialWrt(hParam p) const;
     double Eval() const;
     uint64_t ParamsUsed() const;
+    void ParamsUsedList(std::vector<hParam> *list) const;
     bool DependsOn(hParam p) const;
     static bool Tol(double a, double b);
     Expr *FoldConstants();
-    void Substitute(hParam oldh, hParam newh);
+    Expr *Substitute(hParam oldh, hParam newh);
+    // Substitute every param that's a key of subst at once
+    Expr *Substitute(const std::unordered_map<uint32_t, hParam> &subst);
 
     static const hParam NO_PARAMS, MULTIPLE_PARAMS;
     hParam ReferencedParams(ParamList *pl) const;
@@ -94,12 +97,102 @@ public:
     // resolved to pointers to the actual value. This speeds things up
     // considerably.
     Expr *DeepCopyWithParamsAsPointers(IdList<Param,hParam> *firstTry,
-                                       IdList<Param,hParam> *thenTry) const;
+                                       IdList<Param,hParam> *thenTry,
+                                       IdList<Param,hParam> *lastTry) const;
 
     static Expr *Parse(const char *input, std::string *error);
     static Expr *From(const char *in, bool popUpError);
 };
 
+// A table of the expressions built so far, so that building an expression
+// that's structurally identical to one already in the table gives back that
+// same node. Common subexpressions are therefore shared, which saves memory,
+// and lets the tape compile them only once. Since the nodes never change
+// after they're built, sharing them is safe. The nodes are temporaries, so
+// the table must only be active until they're freed.
+class ExprTable {
+public:
+    struct Hash {
+        size_t operator()(const Expr *e) const;
+    };
+    struct Equal {
+        bool operator()(const Expr *ea, const Expr *eb) const;
+    };
+
+    std::unordered_set<Expr *, Hash, Equal> nodes;
+
+    // The table that new expressions go in to on this thread, if any
+    static thread_local ExprTable *active;
+
+    // Activates a table for as long as it's in scope, and then forgets all
+    // the nodes in it.
+    class Scope {
+    public:
+        ExprTable   *table;
+        ExprTable   *previous;
+
+        Scope(ExprTable *t);
+        ~Scope();
+    };
+
+    Expr *Intern(const Expr &e);
+    void Clear();
+};
+
+// A set of expressions, compiled to a flat list of instructions that each
+// write one register, so that they can all be evaluated in one pass over
+// contiguous memory instead of by recursing through the trees. Params are
+// loaded once per evaluation, and constants live in their registers.
+class ExprTape {
+public:
+    struct Instruction {
+        Expr::Op    op;
+        int         dest;
+        int         a, b;
+    };
+
+    // For each expression compiled with its gradient, the instructions that
+    // it depends on (in order), and the params that it loads, as the ranges
+    // [code, codeEnd) of gradCode and [params, paramsEnd) of gradParams.
+    struct Gradient {
+        int         output;
+        int         code, codeEnd;
+        int         params, paramsEnd;
+    };
+
+    std::vector<Instruction>            code;
+    std::vector<std::pair<int, Param *>> params;
+    std::vector<double>                 reg;
+    // The register that holds the value of each compiled expression
+    std::vector<int>                    outputs;
+
+    std::vector<Gradient>               gradients;
+    std::vector<int>                    gradCode;
+    std::vector<int>                    gradParams;
+    std::vector<double>                 adjoint;
+    // The instruction or the param that writes each register, or -1
+    std::vector<int>                    regCode;
+    std::vector<int>                    regParam;
+    std::vector<int>                    regMark;
+    int                                 mark;
+
+    std::unordered_map<const Expr *, int> exprReg;
+    std::unordered_map<Param *, int>     paramReg;
+
+    void Clear();
+    int Compile(const Expr *e);
+    int CompileWithGradient(const Expr *e);
+    int CompileExpr(const Expr *e);
+    int AllocRegister(double v = 0.0);
+    // Evaluate, writing the value of each compiled expression to out[].
+    void Eval(double *out);
+    // Evaluate, and then find the partial of each expression compiled with
+    // its gradient with respect to each param that it loads, by sweeping
+    // backwards over its instructions; grad[i] gets the partial for the
+    // param params[gradParams[i]].
+    void EvalWithGradient(double *out, double *grad);
+};
+
 class ExprVector {
 public:
     Expr *x, *y, *z;
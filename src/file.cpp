@@ -33,6 +33,9 @@ void SolveSpaceUI::ClearExisting() {
 
     SK.entity.Clear();
     SK.param.Clear();
+
+    // The next sketch may be any size, so measure it before meshing.
+    modelSize = 0.0;
 }
 
 hGroup SolveSpaceUI::CreateDefaultDrawingGroup() {
@@ -113,6 +116,7 @@ const SolveSpaceUI::SaveTable SolveSpaceUI::SAVED[] = {
     { 'g',  "Group.suppress",           'b',    &(SS.sv.g.suppress)           },
     { 'g',  "Group.relaxConstraints",   'b',    &(SS.sv.g.relaxConstraints)   },
     { 'g',  "Group.allowRedundant",     'b',    &(SS.sv.g.allowRedundant)     },
+    { 'g',  "Group.solveMethod",        'd',    &(SS.sv.g.solveMethod)        },
     { 'g',  "Group.allDimsReference",   'b',    &(SS.sv.g.allDimsReference)   },
     { 'g',  "Group.scale",              'f',    &(SS.sv.g.scale)              },
     { 'g',  "Group.remap",              'M',    &(SS.sv.g.remap)              },
@@ -464,24 +468,24 @@ bool SolveSpaceUI::LoadFromFile(const std::string &filename, bool canCancel) {
             if(sv.g.type == Group::Type::LINKED)
                 sv.g.opA.v = 0;
 
-            SK.group.Add(&(sv.g));
+            SK.group.Append(&(sv.g));
             sv.g = {};
             sv.g.scale = 1; // default is 1, not 0; so legacy files need this
         } else if(strcmp(line, "AddParam")==0) {
             // params are regenerated, but we want to preload the values
             // for initial guesses
-            SK.param.Add(&(sv.p));
+            SK.param.Append(&(sv.p));
             sv.p = {};
         } else if(strcmp(line, "AddEntity")==0) {
             // entities are regenerated
         } else if(strcmp(line, "AddRequest")==0) {
-            SK.request.Add(&(sv.r));
+            SK.request.Append(&(sv.r));
             sv.r = {};
         } else if(strcmp(line, "AddConstraint")==0) {
-            SK.constraint.Add(&(sv.c));
+            SK.constraint.Append(&(sv.c));
             sv.c = {};
         } else if(strcmp(line, "AddStyle")==0) {
-            SK.style.Add(&(sv.s));
+            SK.style.Append(&(sv.s));
             sv.s = {};
             Style::FillDefaultStyle(&sv.s);
         } else if(strcmp(line, VERSION_STRING)==0) {
@@ -504,6 +508,15 @@ bool SolveSpaceUI::LoadFromFile(const std::string &filename, bool canCancel) {
 
     fclose(fh);
 
+    // Everything was added in the order that it was saved, which is mostly
+    // but not always sorted, so sort it all at once now; and a handle that
+    // appears twice means the file is corrupt.
+    if(!SK.group.SortAppended())        fileLoadError = true;
+    if(!SK.param.SortAppended())        fileLoadError = true;
+    if(!SK.request.SortAppended())      fileLoadError = true;
+    if(!SK.constraint.SortAppended())   fileLoadError = true;
+    if(!SK.style.SortAppended())        fileLoadError = true;
+
     if(fileLoadError) {
         Error(_("Unrecognized data in file. This file may be corrupt, or "
                 "from a newer version of the program."));
@@ -694,7 +707,7 @@ bool SolveSpaceUI::LoadEntitiesFromFile(const std::string &filename, EntityList
         } else if(strcmp(line, "AddParam")==0) {
 
         } else if(strcmp(line, "AddEntity")==0) {
-            le->Add(&(sv.e));
+            le->Append(&(sv.e));
             sv.e = {};
         } else if(strcmp(line, "AddRequest")==0) {
 
@@ -791,7 +804,7 @@ bool SolveSpaceUI::LoadEntitiesFromFile(const std::string &filename, EntityList
     }
 
     fclose(fh);
-    return true;
+    return le->SortAppended();
 }
 
 //-----------------------------------------------------------------------------
@@ -8,39 +8,39 @@
 //-----------------------------------------------------------------------------
 #include "solvespace.h"
 
+// If the size of the model changes by more than this fraction, then the
+// meshes that we generated for display are too coarse or fine, so redo them.
+static const double MODEL_SIZE_CHANGE_TO_REMESH = 0.1;
+
 void SolveSpaceUI::MarkGroupDirtyByEntity(hEntity he) {
     Entity *e = SK.GetEntity(he);
     MarkGroupDirty(e->group);
 }
 
-void SolveSpaceUI::MarkGroupDirty(hGroup hg, bool onlyThis) {
-    int i;
-    bool go = false;
-    for(i = 0; i < SK.groupOrder.n; i++) {
-        Group *g = SK.GetGroup(SK.groupOrder.elem[i]);
-        if(g->h.v == hg.v) {
-            go = true;
-        }
-        if(go) {
-            g->clean = false;
-            if(onlyThis) break;
-        }
-    }
+void SolveSpaceUI::MarkGroupDirty(hGroup hg) {
+    // Only this group; the groups that depend on it are found, and marked
+    // dirty in turn, when we regenerate.
+    Group *g = SK.group.FindByIdNoOops(hg);
+    if(g) g->clean = false;
     unsaved = true;
     ScheduleGenerateAll();
 }
 
 bool SolveSpaceUI::PruneOrphans() {
+    bool pruned = false;
     int i;
+    SK.request.ClearTags();
     for(i = 0; i < SK.request.n; i++) {
         Request *r = &(SK.request.elem[i]);
         if(GroupExists(r->group)) continue;
 
         (deleted.requests)++;
-        SK.request.RemoveById(r->h);
-        return true;
+        r->tag = 1;
+        pruned = true;
     }
+    SK.request.RemoveTagged();
 
+    SK.constraint.ClearTags();
     for(i = 0; i < SK.constraint.n; i++) {
         Constraint *c = &(SK.constraint.elem[i]);
         if(GroupExists(c->group)) continue;
@@ -48,10 +48,11 @@ bool SolveSpaceUI::PruneOrphans() {
         (deleted.constraints)++;
         (deleted.nonTrivialConstraints)++;
 
-        SK.constraint.RemoveById(c->h);
-        return true;
+        c->tag = 1;
+        pruned = true;
     }
-    return false;
+    SK.constraint.RemoveTagged();
+    return pruned;
 }
 
 bool SolveSpaceUI::GroupsInOrder(hGroup before, hGroup after) {
@@ -87,32 +88,83 @@ bool SolveSpaceUI::PruneGroups(hGroup hg) {
     }
     (deleted.groups)++;
     SK.group.RemoveById(g->h);
+
+    // And everything in it, which has nowhere to go now.
+    Sketch::GroupItems *items = SK.GetGroupItems(hg);
+    SK.request.ClearTags();
+    for(hRequest hr : items->request) {
+        (deleted.requests)++;
+        SK.GetRequest(hr)->tag = 1;
+    }
+    SK.request.RemoveTagged();
+
+    SK.constraint.ClearTags();
+    for(hConstraint hc : items->constraint) {
+        (deleted.constraints)++;
+        (deleted.nonTrivialConstraints)++;
+        SK.GetConstraint(hc)->tag = 1;
+    }
+    SK.constraint.RemoveTagged();
+
+    SK.groupItems.erase(hg.v);
     return true;
 }
 
 bool SolveSpaceUI::PruneRequests(hGroup hg) {
-    int i;
-    for(i = 0; i < SK.entity.n; i++) {
-        Entity *e = &(SK.entity.elem[i]);
-        if(e->group.v != hg.v) continue;
-
+    Sketch::GroupItems *items = SK.GetGroupItems(hg);
+    bool pruned = false;
+    SK.request.ClearTags();
+    for(hEntity he : items->entity) {
+        Entity *e = SK.GetEntity(he);
         if(EntityExists(e->workplane)) continue;
 
         ssassert(e->h.isFromRequest(), "Only explicitly created entities can be pruned");
 
+        Request *r = SK.GetRequest(e->h.request());
+        if(r->tag) continue;
+
         (deleted.requests)++;
-        SK.request.RemoveById(e->h.request());
-        return true;
+        r->tag = 1;
+        pruned = true;
+    }
+    if(!pruned) return false;
+
+    // Remove what those requests generated too, so that we can go on with
+    // the rest of this group.
+    SK.entity.ClearTags();
+    SK.param.ClearTags();
+    for(hRequest hr : items->request) {
+        if(!SK.GetRequest(hr)->tag) continue;
+
+        int k;
+        for(k = SK.entity.LowerBound(hr.entity(0)); k < SK.entity.n; k++) {
+            if(SK.entity.elem[k].h.v > hr.entity(0xffff).v) break;
+            SK.entity.elem[k].tag = 1;
+        }
+        for(k = SK.param.LowerBound(hr.param(0)); k < SK.param.n; k++) {
+            if(SK.param.elem[k].h.v > hr.param(0xffff).v) break;
+            SK.param.elem[k].tag = 1;
+        }
     }
-    return false;
+    items->entity.erase(std::remove_if(items->entity.begin(), items->entity.end(),
+        [](hEntity he) { return SK.GetEntity(he)->tag != 0; }),
+        items->entity.end());
+    items->request.erase(std::remove_if(items->request.begin(), items->request.end(),
+        [](hRequest hr) { return SK.GetRequest(hr)->tag != 0; }),
+        items->request.end());
+    SK.entity.RemoveTagged();
+    SK.param.RemoveTagged();
+    SK.request.RemoveTagged();
+    return true;
 }
 
 bool SolveSpaceUI::PruneConstraints(hGroup hg) {
-    int i;
-    for(i = 0; i < SK.constraint.n; i++) {
-        Constraint *c = &(SK.constraint.elem[i]);
-        if(c->group.v != hg.v) continue;
-
+    Sketch::GroupItems *items = SK.GetGroupItems(hg);
+    bool pruned = false;
+    SK.constraint.ClearTags();
+    SK.param.ClearTags();
+    for(hConstraint hc : items->constraint) {
+        Constraint *c = SK.GetConstraint(hc);
         if(EntityExists(c->workplane) &&
            EntityExists(c->ptA) &&
            EntityExists(c->ptB) &&
@@ -132,14 +184,23 @@ bool SolveSpaceUI::PruneConstraints(hGroup hg) {
             (deleted.nonTrivialConstraints)++;
         }
 
-        SK.constraint.RemoveById(c->h);
-        return true;
+        c->tag = 1;
+        Param *p = SK.param.FindByIdNoOops(hc.param(0));
+        if(p) p->tag = 1;
+        pruned = true;
     }
-    return false;
+    if(!pruned) return false;
+
+    items->constraint.erase(std::remove_if(items->constraint.begin(), items->constraint.end(),
+        [](hConstraint hc) { return SK.GetConstraint(hc)->tag != 0; }),
+        items->constraint.end());
+    SK.constraint.RemoveTagged();
+    SK.param.RemoveTagged();
+    return true;
 }
 
-void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox) {
-    int first = 0, last = 0, i, j;
+void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree) {
+    int first = 0, last = 0, i;
 
     uint64_t startMillis = GetMilliseconds(),
              endMillis;
@@ -169,9 +230,10 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
                 }
             }
             if(first == INT_MAX || last == 0) {
-                // All clean; so just regenerate the entities, and don't solve anything.
+                // All clean; so just regenerate the entities, and don't solve
+                // anything, unless pruning below leaves a shown group dirty.
                 first = -1;
-                last  = -1;
+                if(last == 0) last = -1;
             } else {
                 SS.nakedEdges.Clear();
             }
@@ -200,15 +262,12 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
         }
     }
 
-    // If we're generating entities for display, first we need to find
-    // the bounding box to turn relative chord tolerance to absolute.
-    if(!SS.exportMode && !genForBBox) {
-        GenerateAll(type, andFindFree, /*genForBBox=*/true);
-        BBox box = SK.CalculateEntityBBox(/*includeInvisibles=*/true);
-        Vector size = box.maxp.Minus(box.minp);
-        double maxSize = std::max({ size.x, size.y, size.z });
-        chordTolCalculated = maxSize * chordTol / 100.0;
-    }
+    // The chord tolerance for display is relative to the size of the model,
+    // which we don't know until we've solved it; so mesh using the size from
+    // last time, and then check that below. If there was no last time, then
+    // don't mesh until we know.
+    chordTolCalculated = modelSize * chordTol / 100.0;
+    bool deferMesh = (!SS.exportMode && modelSize == 0.0);
 
     // Remove any requests or constraints that refer to a nonexistent
     // group; can check those immediately, since we know what the list
@@ -224,72 +283,164 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
     SK.entity.Clear();
     SK.entity.ReserveMore(oldEntityCount);
 
+    // The entities are indexed by group as we generate them.
+    SK.IndexGroups();
+
+    // The groups that we've solved, or meshed, on this pass; anything that
+    // depends on those must be solved or meshed too.
+    std::unordered_set<uint32_t> solved, meshed;
+
     for(i = 0; i < SK.groupOrder.n; i++) {
         Group *g = SK.GetGroup(SK.groupOrder.elem[i]);
 
         // The group may depend on entities or other groups, to define its
         // workplane geometry or for its operands. Those must already exist
         // in a previous group, so check them before generating.
-        if(PruneGroups(g->h))
-            goto pruned;
-
-        for(j = 0; j < SK.request.n; j++) {
-            Request *r = &(SK.request.elem[j]);
-            if(r->group.v != g->h.v) continue;
-
-            r->Generate(&(SK.entity), &(SK.param));
+        if(PruneGroups(g->h)) {
+            std::move(&SK.groupOrder.elem[i + 1], &SK.groupOrder.elem[SK.groupOrder.n],
+                      &SK.groupOrder.elem[i]);
+            SK.groupOrder.RemoveLast(1);
+            // The group after it builds on a different mesh now.
+            if(i < SK.groupOrder.n) {
+                SK.GetGroup(SK.groupOrder.elem[i])->clean = false;
+            }
+            if(first > i) first--;
+            if(last >= i && last != INT_MAX) last--;
+            i--;
+            continue;
         }
-        for(j = 0; j < SK.constraint.n; j++) {
-            Constraint *c = &SK.constraint.elem[j];
-            if(c->group.v != g->h.v) continue;
 
-            c->Generate(&(SK.param));
+        Sketch::GroupItems *items = SK.GetGroupItems(g->h);
+        for(hRequest hr : items->request) {
+            SK.GetRequest(hr)->Generate(&(SK.entity), &(SK.param));
+        }
+        for(hConstraint hc : items->constraint) {
+            SK.GetConstraint(hc)->Generate(&(SK.param));
         }
         g->Generate(&(SK.entity), &(SK.param));
 
+        // Everything that we just generated has a handle from one of those
+        // requests or from the group, so find it by those handles.
+        auto indexEntities = [&](hEntity first, hEntity last) {
+            for(int k = SK.entity.LowerBound(first); k < SK.entity.n; k++) {
+                hEntity he = SK.entity.elem[k].h;
+                if(he.v > last.v) break;
+                items->entity.push_back(he);
+            }
+        };
+        for(hRequest hr : items->request) {
+            indexEntities(hr.entity(0), hr.entity(0xffff));
+        }
+        indexEntities(g->h.entity(0), g->h.entity(0xffff));
+
         // The requests and constraints depend on stuff in this or the
-        // previous group, so check them after generating.
-        if(PruneRequests(g->h) || PruneConstraints(g->h))
-            goto pruned;
+        // previous group, so check them after generating. Removing some
+        // can leave others in this group hanging, so keep going until
+        // there are none; the later groups haven't been generated yet.
+        // Whatever's left must be solved again.
+        while(PruneRequests(g->h) || PruneConstraints(g->h)) {
+            g->clean = false;
+        }
+
+        // The params that we just generated have handles from those same
+        // requests and constraints or the group; find each along with the
+        // same param from before, if we had it. Both lists are sorted, so
+        // walk through them together.
+        auto forEachNewParam = [&](std::function<void(Param *, Param *)> fn) {
+            auto walk = [&](hParam first, hParam last) {
+                int l = prev.LowerBound(first);
+                for(int k = SK.param.LowerBound(first); k < SK.param.n; k++) {
+                    Param *newp = &(SK.param.elem[k]);
+                    if(newp->h.v > last.v) break;
+                    while(l < prev.n && prev.elem[l].h.v < newp->h.v) l++;
+                    Param *prevp = NULL;
+                    if(l < prev.n && prev.elem[l].h.v == newp->h.v) {
+                        prevp = &(prev.elem[l]);
+                    }
+                    fn(newp, prevp);
+                }
+            };
+            for(hRequest hr : items->request) {
+                walk(hr.param(0), hr.param(0xffff));
+            }
+            for(hConstraint hc : items->constraint) {
+                walk(hc.param(0), hc.param(0));
+            }
+            walk(g->h.param(0), g->h.param(0xffff));
+        };
 
         // Use the previous values for params that we've seen before, as
         // initial guesses for the solver.
-        for(j = 0; j < SK.param.n; j++) {
-            Param *newp = &(SK.param.elem[j]);
-            if(newp->known) continue;
-
-            Param *prevp = prev.FindByIdNoOops(newp->h);
-            if(prevp) {
-                newp->val = prevp->val;
-                newp->free = prevp->free;
-            }
-        }
+        forEachNewParam([&](Param *newp, Param *prevp) {
+            if(newp->known || !prevp) return;
+            newp->val = prevp->val;
+            newp->free = prevp->free;
+        });
 
         if(g->h.v == Group::HGROUP_REFERENCES.v) {
             ForceReferences();
             g->solved.how = SolveResult::OKAY;
             g->clean = true;
         } else {
-            if(i >= first && i <= last) {
-                // The group falls inside the range, so really solve it,
-                // and then regenerate the mesh based on the solved stuff.
-                if(genForBBox) {
+            bool solve  = (i >= first && i <= last),
+                 remesh = solve;
+            if(type == Generate::DIRTY) {
+                // Of the groups in the range, solve only the ones that are
+                // dirty or that use something that we just solved, and mesh
+                // again the ones that build on a mesh that we just made.
+                Group *rg = g->RunningMeshGroup();
+                solve  = !g->clean || !g->IsSolvedOkay() || g->DependsOnAny(solved);
+                remesh = solve || (rg && meshed.count(rg->h.v) > 0);
+                if(i > last) {
+                    // Hidden, so leave it for when it's shown.
+                    if(remesh) g->clean = false;
+                    solve  = false;
+                    remesh = false;
+                }
+            }
+
+            if(solve) {
+                // The group needs it, so really solve it. When exporting,
+                // it's solved already.
+                if(!SS.exportMode) {
                     SolveGroupAndReport(g->h, andFindFree);
-                } else {
-                    g->GenerateLoops();
-                    g->GenerateShellAndMesh();
-                    g->clean = true;
                 }
+                solved.insert(g->h.v);
             } else {
-                // The group falls outside the range, so just assume that
-                // it's good wherever we left it. The mesh is unchanged,
-                // and the parameters must be marked as known.
-                for(j = 0; j < SK.param.n; j++) {
-                    Param *newp = &(SK.param.elem[j]);
-
-                    Param *prevp = prev.FindByIdNoOops(newp->h);
+                // Just assume that it's good wherever we left it, so the
+                // parameters must be marked as known.
+                forEachNewParam([&](Param *newp, Param *prevp) {
                     if(prevp) newp->known = true;
+                });
+            }
+            if(remesh) {
+                // Regenerate the mesh based on the solved stuff; otherwise
+                // it's unchanged.
+                if(!deferMesh) {
+                    g->GenerateLoops();
+                    g->GenerateShellAndMesh();
                 }
+                g->clean = true;
+                meshed.insert(g->h.v);
+            }
+        }
+    }
+
+    // Now that we've solved, check whether the model changed size enough
+    // that we should mesh again, or mesh for the first time if we held off.
+    if(!SS.exportMode) {
+        BBox box = SK.CalculateEntityBBox(/*includeInvisibles=*/true);
+        Vector size = box.maxp.Minus(box.minp);
+        double maxSize = std::max({ size.x, size.y, size.z });
+        if(deferMesh ||
+           ffabs(maxSize - modelSize) > MODEL_SIZE_CHANGE_TO_REMESH * maxSize) {
+            modelSize = maxSize;
+            chordTolCalculated = modelSize * chordTol / 100.0;
+            for(i = max(first, 0); i <= last && i < SK.groupOrder.n; i++) {
+                Group *g = SK.GetGroup(SK.groupOrder.elem[i]);
+                if(g->h.v == Group::HGROUP_REFERENCES.v) continue;
+                g->GenerateLoops();
+                g->GenerateShellAndMesh();
             }
         }
     }
@@ -315,6 +466,9 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
     prev.Clear();
     InvalidateGraphics();
 
+    // Forget what we compiled to solve any group that's gone now.
+    sys.ForgetRemovedGroups();
+
     // Remove nonexistent selection items, for same reason we waited till
     // the end to put up a dialog box.
     GW.ClearNonexistentSelectionItems();
@@ -372,20 +526,10 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
             case Generate::UNTIL_ACTIVE:    typeStr = "UNTIL_ACTIVE"; break;
         }
         if(endMillis)
-        dbp("Generate::%s%s took %lld ms",
+        dbp("Generate::%s took %lld ms",
             typeStr,
-            (genForBBox ? " (for bounding box)" : ""),
             GetMilliseconds() - startMillis);
     }
-
-    return;
-
-pruned:
-    // Restore the numerical guesses
-    SK.param.Clear();
-    prev.MoveSelfInto(&(SK.param));
-    // Try again
-    GenerateAll(type, andFindFree, genForBBox);
 }
 
 void SolveSpaceUI::ForceReferences() {
@@ -510,17 +654,12 @@ void SolveSpaceUI::WriteEqSystemForGroup(hGroup hg) {
     sys.param.Clear();
     sys.eq.Clear();
     // And generate all the params for requests in this group
-    for(i = 0; i < SK.request.n; i++) {
-        Request *r = &(SK.request.elem[i]);
-        if(r->group.v != hg.v) continue;
-
-        r->Generate(&(sys.entity), &(sys.param));
+    Sketch::GroupItems *items = SK.GetGroupItems(hg);
+    for(hRequest hr : items->request) {
+        SK.GetRequest(hr)->Generate(&(sys.entity), &(sys.param));
     }
-    for(i = 0; i < SK.constraint.n; i++) {
-        Constraint *c = &SK.constraint.elem[i];
-        if(c->group.v != hg.v) continue;
-
-        c->Generate(&(sys.param));
+    for(hConstraint hc : items->constraint) {
+        SK.GetConstraint(hc)->Generate(&(sys.param));
     }
     // And for the group itself
     Group *g = SK.GetGroup(hg);
@@ -536,6 +675,9 @@ void SolveSpaceUI::WriteEqSystemForGroup(hGroup hg) {
 }
 
 void SolveSpaceUI::SolveGroup(hGroup hg, bool andFindFree) {
+    // Free the expressions that we write to solve, as we go, but not the
+    // temporaries from the groups that we've already generated.
+    TemporaryMark mark = MarkTemporary();
     WriteEqSystemForGroup(hg);
     Group *g = SK.GetGroup(hg);
     g->solved.remove.Clear();
@@ -548,15 +690,18 @@ void SolveSpaceUI::SolveGroup(hGroup hg, bool andFindFree) {
         g->dofCheckOk = true;
     }
     g->solved.how = how;
-    FreeAllTemporary();
+    ReleaseTemporary(mark);
 }
 
 SolveResult SolveSpaceUI::TestRankForGroup(hGroup hg) {
+    // This is done as constraints are added, before we regenerate.
+    TemporaryMark mark = MarkTemporary();
+    SK.IndexGroups();
     WriteEqSystemForGroup(hg);
     Group *g = SK.GetGroup(hg);
     SolveResult result = sys.SolveRank(g, NULL, NULL, false, false,
                                        /*forceDofCheck=*/!g->dofCheckOk);
-    FreeAllTemporary();
+    ReleaseTemporary(mark);
     return result;
 }
 
@@ -585,6 +585,49 @@ bool Group::IsSolvedOkay() {
            (this->allowRedundant && this->solved.how == SolveResult::REDUNDANT_OKAY);
 }
 
+// Whether this group uses anything from any of those groups: operands, or
+// entities that define its workplane, or entities that its requests and
+// constraints refer to. If so, then it must be solved again when they are.
+bool Group::DependsOnAny(const std::unordered_set<uint32_t> &groups) {
+    if(groups.empty()) return false;
+
+    auto isIn = [&](hGroup hg) {
+        return hg.v != h.v && groups.count(hg.v) > 0;
+    };
+    auto isEntityIn = [&](hEntity he) {
+        if(he.v == Entity::NO_ENTITY.v) return false;
+        Entity *e = SK.entity.FindByIdNoOops(he);
+        return e != NULL && isIn(e->group);
+    };
+
+    if(isIn(opA) || isIn(opB)) return true;
+    if(isEntityIn(predef.origin) ||
+       isEntityIn(predef.entityB) ||
+       isEntityIn(predef.entityC))
+    {
+        return true;
+    }
+
+    Sketch::GroupItems *items = SK.GetGroupItems(h);
+    for(hEntity he : items->entity) {
+        if(isEntityIn(SK.GetEntity(he)->workplane)) return true;
+    }
+    for(hConstraint hc : items->constraint) {
+        Constraint *c = SK.GetConstraint(hc);
+        if(isEntityIn(c->workplane) ||
+           isEntityIn(c->ptA) ||
+           isEntityIn(c->ptB) ||
+           isEntityIn(c->entityA) ||
+           isEntityIn(c->entityB) ||
+           isEntityIn(c->entityC) ||
+           isEntityIn(c->entityD))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 void Group::AddEq(IdList<Equation,hEquation> *l, Expr *expr, int index) {
     Equation eq;
     eq.e = expr;
@@ -5,13 +5,40 @@
 // Copyright 2008-2013 Jonathan Westhues.
 //-----------------------------------------------------------------------------
 #include "solvespace.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
 #define EXPORT_DLL
 #include <slvs.h>
 
-Sketch SolveSpace::SK = {};
-static System SYS;
+// Everything that we need to solve a system, so that separate contexts can
+// be solving at once, on separate threads.
+struct Slvs_Context {
+    Sketch      sk;
+    System      sys;
 
-static int IsInit = 0;
+    // The group of each param in the sketch that we loaded, since the
+    // Param itself doesn't have one
+    std::vector<std::pair<hParam, Slvs_hGroup>> paramGroup;
+    // Whether Slvs_LoadSystem() left a system here to solve
+    bool        loaded = false;
+};
+
+thread_local Sketch SolveSpace::SK;
+static Slvs_Context DefaultContext;
+
+static std::once_flag InitOnce;
+
+// Moves a context's sketch in to this thread's SK, for as long as it's in
+// scope; that's just a swap of the lists, so pointers in to them stay good.
+// Meanwhile the context holds whatever SK held, so these don't nest.
+class SketchScope {
+public:
+    Sketch      *sk;
+
+    SketchScope(Sketch *sk) : sk(sk) { std::swap(SK, *sk); }
+    ~SketchScope() { std::swap(SK, *sk); }
+};
 
 void Group::GenerateEquations(IdList<Equation,hEquation> *) {
     // Nothing to do for now.
@@ -33,112 +60,40 @@ void SolveSpace::DoMessageBox(const char *, int, int, bool)
     abort();
 }
 
-extern "C" {
-
-void Slvs_QuaternionU(double qw, double qx, double qy, double qz,
-                         double *x, double *y, double *z)
-{
-    Quaternion q = Quaternion::From(qw, qx, qy, qz);
-    Vector v = q.RotationU();
-    *x = v.x;
-    *y = v.y;
-    *z = v.z;
-}
-
-void Slvs_QuaternionV(double qw, double qx, double qy, double qz,
-                         double *x, double *y, double *z)
-{
-    Quaternion q = Quaternion::From(qw, qx, qy, qz);
-    Vector v = q.RotationV();
-    *x = v.x;
-    *y = v.y;
-    *z = v.z;
-}
-
-void Slvs_QuaternionN(double qw, double qx, double qy, double qz,
-                         double *x, double *y, double *z)
-{
-    Quaternion q = Quaternion::From(qw, qx, qy, qz);
-    Vector v = q.RotationN();
-    *x = v.x;
-    *y = v.y;
-    *z = v.z;
-}
-
-void Slvs_MakeQuaternion(double ux, double uy, double uz,
-                         double vx, double vy, double vz,
-                         double *qw, double *qx, double *qy, double *qz)
-{
-    Vector u = Vector::From(ux, uy, uz),
-           v = Vector::From(vx, vy, vz);
-    Quaternion q = Quaternion::From(u, v);
-    *qw = q.w;
-    *qx = q.vx;
-    *qy = q.vy;
-    *qz = q.vz;
-}
-
-void Slvs_Solve(Slvs_System *ssys, Slvs_hGroup shg)
-{
-    if(!IsInit) {
-        InitPlatform(0, NULL);
-        IsInit = 1;
+static bool MakeEntity(const Slvs_Entity *se, EntityBase *e) {
+    switch(se->type) {
+case SLVS_E_POINT_IN_3D:        e->type = Entity::Type::POINT_IN_3D; break;
+case SLVS_E_POINT_IN_2D:        e->type = Entity::Type::POINT_IN_2D; break;
+case SLVS_E_NORMAL_IN_3D:       e->type = Entity::Type::NORMAL_IN_3D; break;
+case SLVS_E_NORMAL_IN_2D:       e->type = Entity::Type::NORMAL_IN_2D; break;
+case SLVS_E_DISTANCE:           e->type = Entity::Type::DISTANCE; break;
+case SLVS_E_WORKPLANE:          e->type = Entity::Type::WORKPLANE; break;
+case SLVS_E_LINE_SEGMENT:       e->type = Entity::Type::LINE_SEGMENT; break;
+case SLVS_E_CUBIC:              e->type = Entity::Type::CUBIC; break;
+case SLVS_E_CIRCLE:             e->type = Entity::Type::CIRCLE; break;
+case SLVS_E_ARC_OF_CIRCLE:      e->type = Entity::Type::ARC_OF_CIRCLE; break;
+
+default: return false;
     }
+    e->h.v          = se->h;
+    e->group.v      = se->group;
+    e->workplane.v  = se->wrkpl;
+    e->point[0].v   = se->point[0];
+    e->point[1].v   = se->point[1];
+    e->point[2].v   = se->point[2];
+    e->point[3].v   = se->point[3];
+    e->normal.v     = se->normal;
+    e->distance.v   = se->distance;
+    e->param[0].v   = se->param[0];
+    e->param[1].v   = se->param[1];
+    e->param[2].v   = se->param[2];
+    e->param[3].v   = se->param[3];
+    return true;
+}
 
-    int i;
-    for(i = 0; i < ssys->params; i++) {
-        Slvs_Param *sp = &(ssys->param[i]);
-        Param p = {};
-
-        p.h.v = sp->h;
-        p.val = sp->val;
-        SK.param.Add(&p);
-        if(sp->group == shg) {
-            SYS.param.Add(&p);
-        }
-    }
-
-    for(i = 0; i < ssys->entities; i++) {
-        Slvs_Entity *se = &(ssys->entity[i]);
-        EntityBase e = {};
-
-        switch(se->type) {
-case SLVS_E_POINT_IN_3D:        e.type = Entity::Type::POINT_IN_3D; break;
-case SLVS_E_POINT_IN_2D:        e.type = Entity::Type::POINT_IN_2D; break;
-case SLVS_E_NORMAL_IN_3D:       e.type = Entity::Type::NORMAL_IN_3D; break;
-case SLVS_E_NORMAL_IN_2D:       e.type = Entity::Type::NORMAL_IN_2D; break;
-case SLVS_E_DISTANCE:           e.type = Entity::Type::DISTANCE; break;
-case SLVS_E_WORKPLANE:          e.type = Entity::Type::WORKPLANE; break;
-case SLVS_E_LINE_SEGMENT:       e.type = Entity::Type::LINE_SEGMENT; break;
-case SLVS_E_CUBIC:              e.type = Entity::Type::CUBIC; break;
-case SLVS_E_CIRCLE:             e.type = Entity::Type::CIRCLE; break;
-case SLVS_E_ARC_OF_CIRCLE:      e.type = Entity::Type::ARC_OF_CIRCLE; break;
-
-default: dbp("bad entity type %d", se->type); return;
-        }
-        e.h.v           = se->h;
-        e.group.v       = se->group;
-        e.workplane.v   = se->wrkpl;
-        e.point[0].v    = se->point[0];
-        e.point[1].v    = se->point[1];
-        e.point[2].v    = se->point[2];
-        e.point[3].v    = se->point[3];
-        e.normal.v      = se->normal;
-        e.distance.v    = se->distance;
-        e.param[0].v    = se->param[0];
-        e.param[1].v    = se->param[1];
-        e.param[2].v    = se->param[2];
-        e.param[3].v    = se->param[3];
-
-        SK.entity.Add(&e);
-    }
-
-    for(i = 0; i < ssys->constraints; i++) {
-        Slvs_Constraint *sc = &(ssys->constraint[i]);
-        ConstraintBase c = {};
-
-        Constraint::Type t;
-        switch(sc->type) {
+static bool MakeConstraint(const Slvs_Constraint *sc, ConstraintBase *c) {
+    Constraint::Type t;
+    switch(sc->type) {
 case SLVS_C_POINTS_COINCIDENT:  t = Constraint::Type::POINTS_COINCIDENT; break;
 case SLVS_C_PT_PT_DISTANCE:     t = Constraint::Type::PT_PT_DISTANCE; break;
 case SLVS_C_PT_PLANE_DISTANCE:  t = Constraint::Type::PT_PLANE_DISTANCE; break;
@@ -174,42 +129,130 @@ case SLVS_C_PROJ_PT_DISTANCE:   t = Constraint::Type::PROJ_PT_DISTANCE; break;
 case SLVS_C_WHERE_DRAGGED:      t = Constraint::Type::WHERE_DRAGGED; break;
 case SLVS_C_CURVE_CURVE_TANGENT:t = Constraint::Type::CURVE_CURVE_TANGENT; break;
 
-default: dbp("bad constraint type %d", sc->type); return;
+default: return false;
+    }
+
+    c->type = t;
+
+    c->h.v          = sc->h;
+    c->group.v      = sc->group;
+    c->workplane.v  = sc->wrkpl;
+    c->valA         = sc->valA;
+    c->ptA.v        = sc->ptA;
+    c->ptB.v        = sc->ptB;
+    c->entityA.v    = sc->entityA;
+    c->entityB.v    = sc->entityB;
+    c->entityC.v    = sc->entityC;
+    c->entityD.v    = sc->entityD;
+    c->other        = (sc->other) ? true : false;
+    c->other2       = (sc->other2) ? true : false;
+    return true;
+}
+
+static void ClearSketch(Slvs_Context *ctx) {
+    ctx->sk.param.Clear();
+    ctx->sk.entity.Clear();
+    ctx->sk.constraint.Clear();
+    ctx->sk.groupItems.clear();
+    ctx->paramGroup.clear();
+    ctx->loaded = false;
+}
+
+// Write the params, entities and constraints of a system in to a context's
+// sketch, in place of whatever was there; false, leaving it empty, if the
+// system has an entity or constraint that we don't know, two of anything
+// with the same handle, or a param with a handle that's reserved. The caller's handles can be in any order, so we add
+// everything and then sort once, rather than insert each in its place.
+static bool LoadSketch(Slvs_Context *ctx, const Slvs_System *ssys) {
+    ClearSketch(ctx);
+
+    int i;
+    for(i = 0; i < ssys->params; i++) {
+        Slvs_Param *sp = &(ssys->param[i]);
+        // Those handles are for the dimensions, when we solve.
+        if((sp->h & System::DIMENSION_PARAM) == System::DIMENSION_PARAM) {
+            ClearSketch(ctx);
+            return false;
         }
+        Param p = {};
+
+        p.h.v = sp->h;
+        p.val = sp->val;
+        ctx->sk.param.Append(&p);
+        ctx->paramGroup.emplace_back(p.h, sp->group);
+    }
+
+    for(i = 0; i < ssys->entities; i++) {
+        EntityBase e = {};
+        if(!MakeEntity(&(ssys->entity[i]), &e)) {
+            ClearSketch(ctx);
+            return false;
+        }
+        ctx->sk.entity.Append(&e);
+    }
+
+    for(i = 0; i < ssys->constraints; i++) {
+        ConstraintBase c = {};
+        if(!MakeConstraint(&(ssys->constraint[i]), &c)) {
+            ClearSketch(ctx);
+            return false;
+        }
+        ctx->sk.constraint.Append(&c);
+    }
 
-        c.type = t;
-
-        c.h.v           = sc->h;
-        c.group.v       = sc->group;
-        c.workplane.v   = sc->wrkpl;
-        c.valA          = sc->valA;
-        c.ptA.v         = sc->ptA;
-        c.ptB.v         = sc->ptB;
-        c.entityA.v     = sc->entityA;
-        c.entityB.v     = sc->entityB;
-        c.entityC.v     = sc->entityC;
-        c.entityD.v     = sc->entityD;
-        c.other         = (sc->other) ? true : false;
-        c.other2        = (sc->other2) ? true : false;
-
-        SK.constraint.Add(&c);
+    bool unique = true;
+    if(!ctx->sk.param.SortAppended())       unique = false;
+    if(!ctx->sk.entity.SortAppended())      unique = false;
+    if(!ctx->sk.constraint.SortAppended())  unique = false;
+    if(!unique) {
+        ClearSketch(ctx);
+        return false;
     }
+    ctx->sk.IndexGroups();
+
+    return true;
+}
+
+// Solve one group of the sketch that we loaded, from the values that its
+// params have in the sketch now, and leave the solution there too. The
+// system gives just the options for the solve, and gets the results.
+static void SolveGroup(Slvs_Context *ctx, Slvs_System *ssys, Slvs_hGroup shg) {
+    SketchScope scope(&ctx->sk);
+    System *sys = &(ctx->sys);
+
+    int i;
+    for(const auto &pg : ctx->paramGroup) {
+        if(pg.second != shg) continue;
+
+        Param *pp = SK.GetParam(pg.first);
+        pp->known = false;
+
+        Param p = {};
+        p.h   = pg.first;
+        p.val = pp->val;
+        sys->param.Append(&p);
+    }
+    // These are unique, since they were in the sketch.
+    sys->param.SortAppended();
 
     for(i = 0; i < (int)arraylen(ssys->dragged); i++) {
         if(ssys->dragged[i]) {
             hParam hp = { ssys->dragged[i] };
-            SYS.dragged.Add(&hp);
+            sys->dragged.Add(&hp);
         }
     }
 
     Group g = {};
     g.h.v = shg;
+    if(ssys->solveMethod == SLVS_SOLVE_DAMPED) {
+        g.solveMethod = Group::SolveMethod::DAMPED;
+    }
 
     List<hConstraint> bad = {};
 
     // Now we're finally ready to solve!
     bool andFindBad = ssys->calculateFaileds ? true : false;
-    SolveResult how = SYS.Solve(&g, &(ssys->dof), &bad, andFindBad, /*andFindFree=*/false);
+    SolveResult how = sys->Solve(&g, &(ssys->dof), &bad, andFindBad, /*andFindFree=*/false);
 
     switch(how) {
         case SolveResult::OKAY:
@@ -224,17 +267,6 @@ default: dbp("bad constraint type %d", sc->type); return;
         case SolveResult::REDUNDANT_OKAY:
             ssys->result = SLVS_RESULT_INCONSISTENT;
             break;
-
-        case SolveResult::TOO_MANY_UNKNOWNS:
-            ssys->result = SLVS_RESULT_TOO_MANY_UNKNOWNS;
-            break;
-    }
-
-    // Write the new parameter values back to our caller.
-    for(i = 0; i < ssys->params; i++) {
-        Slvs_Param *sp = &(ssys->param[i]);
-        hParam hp = { sp->h };
-        sp->val = SK.GetParam(hp)->val;
     }
 
     if(ssys->failed) {
@@ -246,16 +278,250 @@ default: dbp("bad constraint type %d", sc->type); return;
     }
 
     bad.Clear();
-    SYS.param.Clear();
-    SYS.entity.Clear();
-    SYS.eq.Clear();
-    SYS.dragged.Clear();
-
-    SK.param.Clear();
-    SK.entity.Clear();
-    SK.constraint.Clear();
+    sys->param.Clear();
+    sys->entity.Clear();
+    sys->eq.Clear();
+    sys->dragged.Clear();
 
     FreeAllTemporary();
 }
 
+extern "C" {
+
+void Slvs_QuaternionU(double qw, double qx, double qy, double qz,
+                         double *x, double *y, double *z)
+{
+    Quaternion q = Quaternion::From(qw, qx, qy, qz);
+    Vector v = q.RotationU();
+    *x = v.x;
+    *y = v.y;
+    *z = v.z;
+}
+
+void Slvs_QuaternionV(double qw, double qx, double qy, double qz,
+                         double *x, double *y, double *z)
+{
+    Quaternion q = Quaternion::From(qw, qx, qy, qz);
+    Vector v = q.RotationV();
+    *x = v.x;
+    *y = v.y;
+    *z = v.z;
+}
+
+void Slvs_QuaternionN(double qw, double qx, double qy, double qz,
+                         double *x, double *y, double *z)
+{
+    Quaternion q = Quaternion::From(qw, qx, qy, qz);
+    Vector v = q.RotationN();
+    *x = v.x;
+    *y = v.y;
+    *z = v.z;
+}
+
+void Slvs_MakeQuaternion(double ux, double uy, double uz,
+                         double vx, double vy, double vz,
+                         double *qw, double *qx, double *qy, double *qz)
+{
+    Vector u = Vector::From(ux, uy, uz),
+           v = Vector::From(vx, vy, vz);
+    Quaternion q = Quaternion::From(u, v);
+    *qw = q.w;
+    *qx = q.vx;
+    *qy = q.vy;
+    *qz = q.vz;
+}
+
+Slvs_Context *Slvs_CreateContext(void)
+{
+    return new Slvs_Context();
+}
+
+void Slvs_DestroyContext(Slvs_Context *ctx)
+{
+    ClearSketch(ctx);
+    ctx->sys.Clear();
+    delete ctx;
+}
+
+void Slvs_Solve(Slvs_System *ssys, Slvs_hGroup shg)
+{
+    Slvs_SolveInContext(&DefaultContext, ssys, shg);
+}
+
+void Slvs_SolveInContext(Slvs_Context *ctx, Slvs_System *ssys, Slvs_hGroup shg)
+{
+    std::call_once(InitOnce, []() { InitPlatform(0, NULL); });
+
+    if(LoadSketch(ctx, ssys)) {
+        SolveGroup(ctx, ssys, shg);
+
+        // Write the new parameter values back to our caller.
+        for(int i = 0; i < ssys->params; i++) {
+            Slvs_Param *sp = &(ssys->param[i]);
+            hParam hp = { sp->h };
+            sp->val = ctx->sk.param.FindById(hp)->val;
+        }
+    } else {
+        ssys->result  = SLVS_RESULT_INVALID;
+        ssys->faileds = 0;
+    }
+
+    ClearSketch(ctx);
+}
+
+int Slvs_LoadSystem(Slvs_Context *ctx, const Slvs_System *ssys)
+{
+    if(!LoadSketch(ctx, ssys)) return SLVS_RESULT_INVALID;
+    ctx->loaded = true;
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_SetParamValue(Slvs_Context *ctx, Slvs_hParam sh, double val)
+{
+    hParam hp = { sh };
+    Param *p = ctx->sk.param.FindByIdNoOops(hp);
+    if(!p) return SLVS_RESULT_INVALID;
+    p->val = val;
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_GetParamValue(Slvs_Context *ctx, Slvs_hParam sh, double *val)
+{
+    hParam hp = { sh };
+    Param *p = ctx->sk.param.FindByIdNoOops(hp);
+    if(!p) return SLVS_RESULT_INVALID;
+    *val = p->val;
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_AddConstraint(Slvs_Context *ctx, const Slvs_Constraint *sc)
+{
+    ConstraintBase c = {};
+    if(!ctx->loaded || !MakeConstraint(sc, &c) ||
+            ctx->sk.constraint.FindByIdNoOops(c.h))
+    {
+        return SLVS_RESULT_INVALID;
+    }
+    ctx->sk.constraint.Add(&c);
+    ctx->sk.GetGroupItems(c.group)->constraint.push_back(c.h);
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_RemoveConstraint(Slvs_Context *ctx, Slvs_hConstraint sh)
+{
+    hConstraint hc = { sh };
+    ConstraintBase *c = ctx->sk.constraint.FindByIdNoOops(hc);
+    if(!c) return SLVS_RESULT_INVALID;
+
+    std::vector<hConstraint> *inGroup = &(ctx->sk.GetGroupItems(c->group)->constraint);
+    inGroup->erase(std::remove_if(inGroup->begin(), inGroup->end(),
+        [&](hConstraint h) { return h.v == hc.v; }), inGroup->end());
+    ctx->sk.constraint.RemoveById(hc);
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_SolveLoaded(Slvs_Context *ctx, Slvs_System *ssys, Slvs_hGroup shg)
+{
+    std::call_once(InitOnce, []() { InitPlatform(0, NULL); });
+
+    // We can't solve without a system, or write back params that it
+    // doesn't have.
+    int i;
+    bool valid = ctx->loaded;
+    for(i = 0; valid && i < ssys->params; i++) {
+        hParam hp = { ssys->param[i].h };
+        if(!ctx->sk.param.FindByIdNoOops(hp)) valid = false;
+    }
+    if(!valid) {
+        ssys->result  = SLVS_RESULT_INVALID;
+        ssys->faileds = 0;
+        return SLVS_RESULT_INVALID;
+    }
+
+    SolveGroup(ctx, ssys, shg);
+
+    for(i = 0; i < ssys->params; i++) {
+        Slvs_Param *sp = &(ssys->param[i]);
+        hParam hp = { sp->h };
+        sp->val = ctx->sk.param.FindById(hp)->val;
+    }
+    return SLVS_RESULT_OKAY;
+}
+
+void Slvs_SolveVariants(Slvs_System *ssys, Slvs_hGroup shg,
+                        Slvs_Variant *variant, int variants, int threads)
+{
+    std::call_once(InitOnce, []() { InitPlatform(0, NULL); });
+
+    std::atomic<int> next(0);
+    auto solveVariants = [&]() {
+        Slvs_Context *ctx = Slvs_CreateContext();
+
+        if(LoadSketch(ctx, ssys)) {
+            int i;
+            // The solver loads each dimension from a param of its own, so
+            // the equations that we compile don't depend on the dimensions,
+            // and we can reuse them for every variant.
+            std::vector<std::pair<ConstraintBase *, int>> dims;
+            for(i = 0; i < ssys->constraints; i++) {
+                hConstraint hc = { ssys->constraint[i].h };
+                ConstraintBase *c = ctx->sk.constraint.FindById(hc);
+                if(c->group.v != shg || !c->HasLabel()) continue;
+                dims.emplace_back(c, i);
+            }
+
+            // Our tables don't change from here on, so these stay put.
+            std::vector<Param *> params;
+            for(i = 0; i < ssys->params; i++) {
+                hParam hp = { ssys->param[i].h };
+                params.push_back(ctx->sk.GetParam(hp));
+            }
+
+            int k;
+            while((k = next++) < variants) {
+                Slvs_Variant *v = &(variant[k]);
+                for(i = 0; i < ssys->params; i++) {
+                    params[i]->val = v->val[i];
+                }
+                for(const auto &d : dims) {
+                    d.first->valA = v->valA ? v->valA[d.second] :
+                                              ssys->constraint[d.second].valA;
+                }
+
+                Slvs_System out = *ssys;
+                out.failed  = v->failed;
+                out.faileds = v->faileds;
+                SolveGroup(ctx, &out, shg);
+                v->faileds = out.faileds;
+                v->dof     = out.dof;
+                v->result  = out.result;
+
+                for(i = 0; i < ssys->params; i++) {
+                    v->val[i] = params[i]->val;
+                }
+            }
+        } else {
+            // Then we can't solve any variant, and no other worker could
+            // load it either.
+            int k;
+            while((k = next++) < variants) {
+                variant[k].result  = SLVS_RESULT_INVALID;
+                variant[k].faileds = 0;
+            }
+        }
+
+        Slvs_DestroyContext(ctx);
+    };
+
+    threads = std::max(1, std::min(threads, variants));
+    std::vector<std::thread> workers;
+    for(int t = 1; t < threads; t++) {
+        workers.emplace_back(solveVariants);
+    }
+    solveVariants();
+    for(std::thread &w : workers) {
+        w.join();
+    }
+}
+
 } /* extern "C" */
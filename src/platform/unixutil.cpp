@@ -1,8 +1,7 @@
 //-----------------------------------------------------------------------------
-// Utility functions used by the Unix port. Notably, our memory allocation;
-// we use two separate allocators, one for long-lived stuff and one for
-// stuff that gets freed after every regeneration of the model, to save us
-// the trouble of freeing the latter explicitly.
+// Utility functions used by the Unix port. Notably, our memory allocation
+// for long-lived stuff; the stuff that gets freed after every regeneration
+// of the model goes on the temporary heap, in util.cpp.
 //
 // Copyright 2008-2013 Jonathan Westhues.
 // Copyright 2013 Daniel Richard G. <skunk@iSKUNK.ORG>
@@ -196,57 +195,6 @@ const void *LoadResource(const std::string &name, size_t *size) {
     return static_cast<const void *>(&(*it).second[0]);
 }
 
-//-----------------------------------------------------------------------------
-// A separate heap, on which we allocate expressions. Maybe a bit faster,
-// since fragmentation is less of a concern, and it also makes it possible
-// to be sloppy with our memory management, and just free everything at once
-// at the end.
-//-----------------------------------------------------------------------------
-
-typedef struct _AllocTempHeader AllocTempHeader;
-
-typedef struct _AllocTempHeader {
-    AllocTempHeader *prev;
-    AllocTempHeader *next;
-} AllocTempHeader;
-
-static AllocTempHeader *Head = NULL;
-
-void *AllocTemporary(size_t n)
-{
-    AllocTempHeader *h =
-        (AllocTempHeader *)malloc(n + sizeof(AllocTempHeader));
-    h->prev = NULL;
-    h->next = Head;
-    if(Head) Head->prev = h;
-    Head = h;
-    memset(&h[1], 0, n);
-    return (void *)&h[1];
-}
-
-void FreeTemporary(void *p)
-{
-    AllocTempHeader *h = (AllocTempHeader *)p - 1;
-    if(h->prev) {
-        h->prev->next = h->next;
-    } else {
-        Head = h->next;
-    }
-    if(h->next) h->next->prev = h->prev;
-    free(h);
-}
-
-void FreeAllTemporary(void)
-{
-    AllocTempHeader *h = Head;
-    while(h) {
-        AllocTempHeader *f = h;
-        h = h->next;
-        free(f);
-    }
-    Head = NULL;
-}
-
 void *MemAlloc(size_t n) {
     void *p = malloc(n);
     ssassert(p != NULL, "Cannot allocate memory");
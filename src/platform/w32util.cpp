@@ -13,7 +13,7 @@
 #include <shellapi.h>
 
 namespace SolveSpace {
-static HANDLE PermHeap, TempHeap;
+static HANDLE PermHeap;
 
 void dbp(const char *str, ...)
 {
@@ -168,49 +168,22 @@ const void *LoadResource(const std::string &name, size_t *size) {
     return LockResource(res);
 }
 
-//-----------------------------------------------------------------------------
-// A separate heap, on which we allocate expressions. Maybe a bit faster,
-// since no fragmentation issues whatsoever, and it also makes it possible
-// to be sloppy with our memory management, and just free everything at once
-// at the end.
-//-----------------------------------------------------------------------------
-void *AllocTemporary(size_t n)
-{
-    void *v = HeapAlloc(TempHeap, HEAP_NO_SERIALIZE | HEAP_ZERO_MEMORY, n);
-    ssassert(v != NULL, "Cannot allocate memory");
-    return v;
-}
-void FreeTemporary(void *p) {
-    HeapFree(TempHeap, HEAP_NO_SERIALIZE, p);
-}
-void FreeAllTemporary()
-{
-    if(TempHeap) HeapDestroy(TempHeap);
-    TempHeap = HeapCreate(HEAP_NO_SERIALIZE, 1024*1024*20, 0);
-    // This is a good place to validate, because it gets called fairly
-    // often.
-    vl();
-}
-
 void *MemAlloc(size_t n) {
-    void *p = HeapAlloc(PermHeap, HEAP_NO_SERIALIZE | HEAP_ZERO_MEMORY, n);
+    void *p = HeapAlloc(PermHeap, HEAP_ZERO_MEMORY, n);
     ssassert(p != NULL, "Cannot allocate memory");
     return p;
 }
 void MemFree(void *p) {
-    HeapFree(PermHeap, HEAP_NO_SERIALIZE, p);
+    HeapFree(PermHeap, 0, p);
 }
 
 void vl() {
-    ssassert(HeapValidate(TempHeap, HEAP_NO_SERIALIZE, NULL), "Corrupted heap");
-    ssassert(HeapValidate(PermHeap, HEAP_NO_SERIALIZE, NULL), "Corrupted heap");
+    ssassert(HeapValidate(PermHeap, 0, NULL), "Corrupted heap");
 }
 
 std::vector<std::string> InitPlatform(int argc, char **argv) {
     // Create the heap used for long-lived stuff (that gets freed piecewise).
-    PermHeap = HeapCreate(HEAP_NO_SERIALIZE, 1024*1024*20, 0);
-    // Create the heap that we use to store Exprs and other temp stuff.
-    FreeAllTemporary();
+    PermHeap = HeapCreate(0, 1024*1024*20, 0);
 
 #if !defined(LIBRARY) && defined(_MSC_VER)
     // Don't display the abort message; it is aggravating in CLI binaries
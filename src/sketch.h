@@ -205,6 +205,14 @@ public:
     };
     CombineAs meshCombine;
 
+    // How the solver takes its steps: each Newton step in full, or damped
+    // (Levenberg-Marquardt), taking only those that reduce the residual.
+    enum class SolveMethod : uint32_t {
+        NEWTON          = 0,
+        DAMPED          = 1
+    };
+    SolveMethod solveMethod;
+
     bool forceToMesh;
 
     IdList<EntityMap,EntityId> remap;
@@ -256,6 +264,7 @@ public:
     void AddEq(IdList<Equation,hEquation> *l, Expr *expr, int index);
     void GenerateEquations(IdList<Equation,hEquation> *l);
     bool IsVisible();
+    bool DependsOnAny(const std::unordered_set<uint32_t> &groups);
     int GetNumConstraints();
     Vector ExtrusionGetVector();
     void ExtrusionForceVectorTo(const Vector &v);
@@ -627,6 +636,9 @@ public:
 
     // These are the parameters for the constraint.
     double      valA;
+    // If set, the value is loaded from this param instead of valA, so that
+    // it can change without changing the equations that we write.
+    hParam      valP;
     hEntity     ptA;
     hEntity     ptB;
     hEntity     entityA;
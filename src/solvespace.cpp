@@ -879,6 +879,7 @@ void Sketch::Clear() {
     style.Clear();
     entity.Clear();
     param.Clear();
+    groupItems.clear();
 }
 
 BBox Sketch::CalculateEntityBBox(bool includingInvisible) {
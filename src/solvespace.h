@@ -238,9 +238,62 @@ float CnfThawFloat(float val, const std::string &name);
 
 std::vector<std::string> InitPlatform(int argc, char **argv);
 
+// The temporary heap is per thread, so that threads never contend for it;
+// FreeAllTemporary() frees just the calling thread's.
 void *AllocTemporary(size_t n);
 void FreeTemporary(void *p);
 void FreeAllTemporary();
+// A point in the temporary heap; releasing it frees everything allocated
+// since it was marked. Marks must be released in the reverse order, and
+// before anything frees all of the heap.
+struct TemporaryMark {
+    size_t  chunk;
+    size_t  used;
+    size_t  large;
+};
+TemporaryMark MarkTemporary();
+void ReleaseTemporary(const TemporaryMark &mark);
+
+// The arena behind the temporary heap. A worker whose results must outlive
+// it allocates them from an arena that its caller owns, and the caller then
+// adopts that arena's memory in to its own temporary heap, or frees it
+// separately, along with the arena.
+class TemporaryArena {
+public:
+    std::vector<char *>                 chunks;
+    // We're allocating from chunks[current], of which used bytes are used
+    size_t                              current = 0;
+    size_t                              used = 0;
+    // The big allocations and adopted chunks in order, or NULL once freed;
+    // only the big allocations can be found by their pointer.
+    std::vector<void *>                 large;
+    std::unordered_map<void *, size_t>  largeIndex;
+
+    // Makes an arena the one that AllocTemporary() uses on this thread, for
+    // as long as it's in scope.
+    class Scope {
+    public:
+        TemporaryArena  *previous;
+
+        Scope(TemporaryArena *arena);
+        ~Scope();
+    };
+
+    TemporaryArena() {}
+    TemporaryArena(const TemporaryArena &) = delete;
+    TemporaryArena &operator=(const TemporaryArena &) = delete;
+    ~TemporaryArena();
+
+    void *Alloc(size_t n);
+    void Free(void *p);
+    TemporaryMark Mark() const;
+    void Release(const TemporaryMark &mark);
+    void FreeAll();
+    void Adopt(TemporaryArena *other);
+};
+// Takes over everything allocated from an arena, so that it's freed with
+// the rest of this thread's temporary heap.
+void AdoptTemporary(TemporaryArena *arena);
 void *MemAlloc(size_t n);
 void MemFree(void *p);
 void vl(); // debug function to validate heaps
@@ -276,8 +329,7 @@ enum class SolveResult : uint32_t {
     OKAY                     = 0,
     DIDNT_CONVERGE           = 10,
     REDUNDANT_OKAY           = 11,
-    REDUNDANT_DIDNT_CONVERGE = 12,
-    TOO_MANY_UNKNOWNS        = 20
+    REDUNDANT_DIDNT_CONVERGE = 12
 };
 
 
@@ -331,8 +383,6 @@ RgbaColor CnfThawColor(RgbaColor v, const std::string &name);
 
 class System {
 public:
-    enum { MAX_UNKNOWNS = 1024 };
-
     EntityList                      entity;
     ParamList                       param;
     IdList<Equation,hEquation>      eq;
@@ -341,62 +391,169 @@ public:
     // we should put as close as possible to their initial positions.
     List<hParam>                    dragged;
 
+    // The values of the dimensions in the equations that we write, as known
+    // params, so that changing a dimension doesn't change the equations.
+    // They're numbered from DIMENSION_PARAM, a range of handles that no
+    // request, group or constraint has params in; and that the library
+    // doesn't take for the caller's params, so nothing else shadows them.
+    ParamList                       dimension;
+    static const uint32_t DIMENSION_PARAM = 0xc0000000;
+
+    // The expressions that we write while solving, with their common
+    // subexpressions shared.
+    ExprTable                       exprs;
+
     enum {
         // In general, the tag indicates the subsys that a variable/equation
         // has been assigned to; these are exceptions for variables:
         VAR_SUBSTITUTED      = 10000,
-        VAR_DOF_TEST         = 10001,
+        VAR_SOLVED_IN_BLOCK  = 10002,
         // and for equations:
-        EQ_SUBSTITUTED       = 20000
+        EQ_SUBSTITUTED       = 20000,
+        EQ_SOLVED_IN_BLOCK   = 20001
     };
 
-    // The system Jacobian matrix
-    struct {
+    // A set of equations, and the params that we solve them for, as indices
+    // in to eq and param; and the other params that those equations use.
+    struct Block {
+        std::vector<int>    eq;
+        std::vector<int>    param;
+        std::vector<int>    uses;
+    };
+
+    // How the partials in the Jacobian are found: automatically, by
+    // sweeping backwards over the compiled equation itself; or by
+    // differentiating each equation symbolically and compiling the partials,
+    // which is slower, but there to compare against.
+    enum class Differentiation : uint32_t {
+        AUTOMATIC            = 0,
+        SYMBOLIC             = 1
+    };
+    Differentiation                 differentiation;
+
+    // How the nonlinear system is solved, as chosen for the group
+    Group::SolveMethod              method;
+
+    // A row of a sparse matrix, as (column, value) pairs.
+    typedef std::vector<std::pair<int, double>> SparseRow;
+
+    // The system Jacobian matrix, sized to whatever we're solving. It has
+    // everything that we need to solve the system once it's written, so
+    // separate blocks can be solved in separate matrices, at the same time.
+    struct Matrix {
         // The corresponding equation for each row
-        hEquation   eq[MAX_UNKNOWNS];
+        std::vector<hEquation>  eq;
 
         // The corresponding parameter for each column
-        hParam      param[MAX_UNKNOWNS];
+        std::vector<hParam>     param;
+        std::vector<Param *>    parp;
 
         // We're solving AX = B
         int m, n;
+        // Only the structurally nonzero partials are stored, in compressed
+        // sparse row form: row i has its entries at row[i] to row[i+1]-1
+        // of col, sym and num, in increasing order of column.
         struct {
-            Expr        *sym[MAX_UNKNOWNS][MAX_UNKNOWNS];
-            double       num[MAX_UNKNOWNS][MAX_UNKNOWNS];
+            std::vector<int>     row;
+            std::vector<int>     col;
+            std::vector<Expr *>  sym;
+            std::vector<double>  num;
+            // The entries of sym, compiled in the same order
+            ExprTape             tape;
+            // Or, when differentiating automatically, the index of each
+            // entry in the gradient of the compiled equations, B.tape
+            std::vector<int>     grad;
+            std::vector<double>  gradient;
         }           A;
 
-        double      scale[MAX_UNKNOWNS];
+        // This scale weights the parameters for the least squares solve
+        std::vector<double>     scale;
+        // and this damps it, as a fraction of the diagonal of A*A'
+        double                  damping;
 
         // Some helpers for the least squares solve
-        double AAt[MAX_UNKNOWNS][MAX_UNKNOWNS];
-        double Z[MAX_UNKNOWNS];
+        std::vector<SparseRow>  AAt;
+        std::vector<double>     Z;
 
-        double      X[MAX_UNKNOWNS];
+        std::vector<double>     X;
 
         struct {
-            Expr        *sym[MAX_UNKNOWNS];
-            double       num[MAX_UNKNOWNS];
+            std::vector<Expr *>  sym;
+            std::vector<double>  num;
+            ExprTape             tape;
         }           B;
-    } mat;
+
+        Differentiation         differentiation;
+        Group::SolveMethod      method;
+        // Whether to update the Jacobian between Newton steps, rather than
+        // evaluate it; that's good while dragging.
+        bool                    quasiNewton;
+        // Whether A.num is good to start from: just evaluated here, or kept
+        // from the end of the last solve while dragging the same params.
+        bool                    haveJacobian;
+
+        // The factorization that CalculateRank() leaves: the row taken at
+        // each step, and for each row its entries in R, as (step, value).
+        struct {
+            std::vector<int>        pivot;
+            std::vector<SparseRow>  R;
+        }           qr;
+
+        int CalculateRank(std::vector<bool> *free = NULL);
+        void FindLeftNullSpace(std::vector<SparseRow> *nullSpace);
+        bool TestRank();
+        bool SolveLeastSquares();
+
+        void EvalJacobian();
+        void EvalFunctions();
+
+        bool NewtonSolve();
+        bool NewtonSolveFromLast();
+        bool DampedSolve();
+    };
+    Matrix                          mat;
+
+    // A matrix as we last wrote it for a block, and the params that its
+    // compiled equations load, by handle; since the param table is written
+    // afresh for every solve, the pointers in to it must be too.
+    struct CompiledMatrix {
+        bool                    valid = false;
+        Block                   block;
+        Matrix                  mat;
+        std::vector<hParam>     aParams, bParams;
+    };
+    // Everything that we compiled to solve a group, and the key that says
+    // whether it still applies: the structure of the equations that we
+    // wrote, which doesn't depend on any value that we load from a param.
+    struct Compiled {
+        std::vector<uint64_t>       key;
+        std::vector<CompiledMatrix> blocks;
+        CompiledMatrix              mat;
+    };
+    std::unordered_map<uint32_t, Compiled> compiled;
 
     static const double RANK_MAG_TOLERANCE, CONVERGE_TOLERANCE;
-    int CalculateRank();
-    bool TestRank();
-    static bool SolveLinearSystem(double X[], double A[][MAX_UNKNOWNS],
+    static const double BROYDEN_MIN_REDUCTION;
+    static bool SolveLinearSystem(double X[], std::vector<SparseRow> *A,
                                   double B[], int N);
-    bool SolveLeastSquares();
 
-    bool WriteJacobian(int tag);
-    void EvalJacobian();
+    // The block's equations load the params that aren't ours from
+    // sketchParam, since a worker thread might not see the sketch.
+    void WriteJacobian(int tag, CompiledMatrix *cm = NULL);
+    void WriteJacobian(const Block &b, Matrix *m, ParamList *sketchParam);
+    void WriteJacobian(const Block &b, Matrix *m, CompiledMatrix *cm,
+                       ParamList *sketchParam);
+    static void KeepJacobian(const Matrix &m, CompiledMatrix *cm);
+    void WriteKey(bool forceDofCheck, std::vector<uint64_t> *key);
+    bool SolveBlocks(const std::vector<Block> &blocks, Compiled *cache);
 
     void WriteEquationsExceptFor(hConstraint hc, Group *g);
-    void FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad, bool forceDofCheck);
+    void FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad);
     void SolveBySubstitution();
+    void FindBlocks(std::vector<Block> *blocks);
 
     bool IsDragged(hParam p);
 
-    bool NewtonSolve(int tag);
-
     void MarkParamsFree(bool findFree);
     int CalculateDof();
 
@@ -406,6 +563,7 @@ public:
     SolveResult SolveRank(Group *g, int *dof, List<hConstraint> *bad,
                           bool andFindBad, bool andFindFree, bool forceDofCheck = false);
 
+    void ForgetRemovedGroups();
     void Clear();
 };
 
@@ -600,6 +758,24 @@ public:
     IdList<ENTITY,hEntity>          entity;
     IdList<Param,hParam>            param;
 
+    // The requests, constraints and entities in each group, so that we
+    // needn't search every list for the few in one group. This isn't kept
+    // up to date as items are added and removed: it's a cache that
+    // IndexGroups() rebuilds from the lists at the start of GenerateAll()
+    // and of TestRankForGroup(), the only things that use it. Only what
+    // those do to the lists after that (generating entities, and pruning)
+    // updates it; and in the library, adding or removing a constraint in a
+    // loaded system, which isn't indexed again.
+    struct GroupItems {
+        std::vector<hRequest>       request;
+        std::vector<hConstraint>    constraint;
+        std::vector<hEntity>        entity;
+    };
+    std::unordered_map<uint32_t, GroupItems> groupItems;
+
+    void IndexGroups();
+    GroupItems *GetGroupItems(hGroup h) { return &groupItems[h.v]; }
+
     inline CONSTRAINT *GetConstraint(hConstraint h)
         { return constraint.FindById(h); }
     inline ENTITY  *GetEntity (hEntity  h) { return entity. FindById(h); }
@@ -665,6 +841,10 @@ public:
     double   ambientIntensity;
     double   chordTol;
     double   chordTolCalculated;
+    // The largest dimension of the model, that the chord tolerance for
+    // display is relative to, as of when it last changed much; or zero, if
+    // it's not known yet
+    double   modelSize;
     int      maxSegments;
     double   exportChordTol;
     int      exportMaxSegments;
@@ -828,7 +1008,7 @@ public:
     };
     Clipboard clipboard;
 
-    void MarkGroupDirty(hGroup hg, bool onlyThis = false);
+    void MarkGroupDirty(hGroup hg);
     void MarkGroupDirtyByEntity(hEntity he);
 
     // Consistency checking on the sketch: stuff with missing dependencies
@@ -855,8 +1035,7 @@ public:
         UNTIL_ACTIVE,
     };
 
-    void GenerateAll(Generate type = Generate::DIRTY, bool andFindFree = false,
-                     bool genForBBox = false);
+    void GenerateAll(Generate type = Generate::DIRTY, bool andFindFree = false);
     void SolveGroup(hGroup hg, bool andFindFree);
     void SolveGroupAndReport(hGroup hg, bool andFindFree);
     SolveResult TestRankForGroup(hGroup hg);
@@ -909,7 +1088,12 @@ void ImportDxf(const std::string &file);
 void ImportDwg(const std::string &file);
 
 extern SolveSpaceUI SS;
+#ifdef LIBRARY
+// The library can solve on several threads at once, so each has its own.
+extern thread_local Sketch SK;
+#else
 extern Sketch SK;
+#endif
 
 }
 
@@ -7,6 +7,11 @@
 // Copyright 2008-2013 Jonathan Westhues.
 //-----------------------------------------------------------------------------
 #include "solvespace.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <thread>
 
 // This tolerance is used to determine whether two (linearized) constraints
 // are linearly dependent. If this is too small, then we will attempt to
@@ -19,61 +24,362 @@ const double System::RANK_MAG_TOLERANCE = 1e-4;
 // always be much less than LENGTH_EPS, and in practice should be much less.
 const double System::CONVERGE_TOLERANCE = (LENGTH_EPS/(1e2));
 
-bool System::WriteJacobian(int tag) {
-    int a, i, j;
+// When we update the Jacobian instead of evaluating it, each step must reduce
+// the sum of the squared residuals to at least this fraction of what it was.
+const double System::BROYDEN_MIN_REDUCTION = 0.25;
 
-    j = 0;
-    for(a = 0; a < param.n; a++) {
-        if(j >= MAX_UNKNOWNS) return false;
+// Most blocks are tiny, so it's not worth another thread to solve fewer
+// than this many of them.
+static const int BLOCKS_PER_THREAD = 32;
 
-        Param *p = &(param.elem[a]);
-        if(p->tag != tag) continue;
-        mat.param[j] = p->h;
-        j++;
+//-----------------------------------------------------------------------------
+// The threads that help to solve blocks. We solve on every drag event, so
+// these are started once and then kept, rather than started for each solve.
+// The caller does its job too, and the helpers just join in if they're free,
+// so a job gets done even when another has all of them busy. They're joined
+// when the workers are destroyed, at exit or when the library is unloaded,
+// so none is left running code that's gone.
+//-----------------------------------------------------------------------------
+class SolveWorkers {
+public:
+    struct Job {
+        const std::function<void()> *work;
+        int                          running;
+    };
+
+    std::mutex                  mutex;
+    std::condition_variable     wake, done;
+    // One entry for each helper that a job wants
+    std::deque<Job *>           queue;
+    std::vector<std::thread>    threads;
+    bool                        shutdown = false;
+
+    static SolveWorkers *Get() {
+        static SolveWorkers workers;
+        return &workers;
     }
-    mat.n = j;
 
-    i = 0;
+    ~SolveWorkers() {
+        std::unique_lock<std::mutex> lock(mutex);
+        shutdown = true;
+        wake.notify_all();
+        lock.unlock();
+        for(std::thread &t : threads) {
+            t.join();
+        }
+    }
+
+    void Help() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true) {
+            wake.wait(lock, [&]() { return shutdown || !queue.empty(); });
+            if(shutdown) return;
+            Job *job = queue.front();
+            queue.pop_front();
+            job->running++;
+            lock.unlock();
+
+            (*job->work)();
+
+            lock.lock();
+            job->running--;
+            done.notify_all();
+        }
+    }
+
+    void Run(int helpers, const std::function<void()> &work) {
+        Job job = { &work, 0 };
+        std::unique_lock<std::mutex> lock(mutex);
+        while((int)threads.size() < helpers) {
+            threads.emplace_back(&SolveWorkers::Help, this);
+        }
+        for(int i = 0; i < helpers; i++) {
+            queue.push_back(&job);
+        }
+        wake.notify_all();
+        lock.unlock();
+
+        work();
+
+        // The work is all done now, so any helper that hasn't started on
+        // it yet needn't; but we must wait for any that has.
+        lock.lock();
+        queue.erase(std::remove(queue.begin(), queue.end(), &job), queue.end());
+        done.wait(lock, [&]() { return job.running == 0; });
+    }
+};
+
+void System::WriteJacobian(int tag, CompiledMatrix *cm) {
+    Block b;
+    int a;
+    for(a = 0; a < param.n; a++) {
+        if(param.elem[a].tag == tag) b.param.push_back(a);
+    }
     for(a = 0; a < eq.n; a++) {
-        if(i >= MAX_UNKNOWNS) return false;
+        if(eq.elem[a].tag == tag) b.eq.push_back(a);
+    }
+    WriteJacobian(b, &mat, cm, &(SK.param));
+}
+
+//-----------------------------------------------------------------------------
+// Write the Jacobian for a block, or if we compiled the same block of the same
+// equations last time, then just point that at the params again.
+//-----------------------------------------------------------------------------
+void System::WriteJacobian(const Block &b, Matrix *m, CompiledMatrix *cm,
+                           ParamList *sketchParam)
+{
+    size_t i;
+    if(cm && cm->valid && cm->block.eq == b.eq && cm->block.param == b.param) {
+        // The params that we're not solving for are loaded from the
+        // dimensions or the main table, just as DeepCopyWithParamsAsPointers()
+        // points at them.
+        auto findParam = [&](hParam hp) {
+            Param *p = param.FindByIdNoOops(hp);
+            if(!p) p = dimension.FindByIdNoOops(hp);
+            return p ? p : sketchParam->FindById(hp);
+        };
+        *m = cm->mat;
+        for(i = 0; i < m->parp.size(); i++) {
+            m->parp[i] = param.FindById(m->param[i]);
+        }
+        for(i = 0; i < cm->aParams.size(); i++) {
+            m->A.tape.params[i].second = findParam(cm->aParams[i]);
+        }
+        for(i = 0; i < cm->bParams.size(); i++) {
+            m->B.tape.params[i].second = findParam(cm->bParams[i]);
+        }
+        return;
+    }
+
+    WriteJacobian(b, m, sketchParam);
+    if(!cm) return;
+
+    // The expressions are gone after this solve, so keep only what we
+    // compiled from them.
+    cm->valid = true;
+    cm->block = b;
+    cm->mat = *m;
+    cm->mat.A.sym.clear();
+    cm->mat.B.sym.clear();
+    for(ExprTape *tape : { &cm->mat.A.tape, &cm->mat.B.tape }) {
+        tape->exprReg.clear();
+        tape->paramReg.clear();
+    }
+    cm->aParams.clear();
+    cm->bParams.clear();
+    for(const auto &p : m->A.tape.params) cm->aParams.push_back(p.second->h);
+    for(const auto &p : m->B.tape.params) cm->bParams.push_back(p.second->h);
+}
+
+//-----------------------------------------------------------------------------
+// While dragging, keep the Jacobian that a block's solve ended with, so that
+// the next solve of that block can start from it.
+//-----------------------------------------------------------------------------
+void System::KeepJacobian(const Matrix &m, CompiledMatrix *cm) {
+    if(!m.quasiNewton || !cm->valid) return;
+    cm->mat.A.num = m.A.num;
+    cm->mat.haveJacobian = true;
+}
+
+//-----------------------------------------------------------------------------
+// Write everything that determines what we'd compile to solve the system that
+// we've written: the equations, and the params that we solve for. Every param
+// is loaded when we evaluate, even a known one, and so is every dimension, so
+// none of their values matter; editing a dimension or an earlier group leaves
+// the key as it was. The rest (the substitutions, the blocks) follows from
+// those.
+//-----------------------------------------------------------------------------
+void System::WriteKey(bool forceDofCheck, std::vector<uint64_t> *key) {
+    auto bits = [](double v) {
+        uint64_t r;
+        memcpy(&r, &v, sizeof(r));
+        return r;
+    };
+    // The equations share their common subexpressions, so write each one
+    // just once, and then refer back to it by the order that we wrote it.
+    std::unordered_map<const Expr *, uint64_t> written;
+    std::function<void(const Expr *)> writeExpr = [&](const Expr *e) {
+        auto it = written.find(e);
+        if(it != written.end()) {
+            key->push_back(UINT64_MAX);
+            key->push_back(it->second);
+            return;
+        }
+        written.emplace(e, written.size());
+
+        key->push_back((uint64_t)e->op);
+        switch(e->op) {
+            case Expr::Op::PARAM:
+                key->push_back(e->parh.v);
+                break;
 
+            case Expr::Op::PARAM_PTR:
+                key->push_back(e->parp->h.v);
+                break;
+
+            case Expr::Op::CONSTANT:
+            case Expr::Op::VARIABLE:
+                key->push_back(bits(e->v));
+                break;
+
+            default:
+                writeExpr(e->a);
+                if(e->Children() > 1) writeExpr(e->b);
+                break;
+        }
+    };
+
+    key->clear();
+    key->push_back(forceDofCheck);
+    key->push_back((uint64_t)differentiation);
+    key->push_back((uint64_t)method);
+    for(hParam *hp = dragged.First(); hp; hp = dragged.NextAfter(hp)) {
+        key->push_back(hp->v);
+    }
+    key->push_back(param.n);
+    for(int i = 0; i < param.n; i++) {
+        key->push_back(param.elem[i].h.v);
+        key->push_back(param.elem[i].known);
+    }
+    key->push_back(eq.n);
+    for(int i = 0; i < eq.n; i++) {
+        key->push_back(eq.elem[i].h.v);
+        writeExpr(eq.elem[i].e);
+    }
+}
+
+void System::WriteJacobian(const Block &b, Matrix *m, ParamList *sketchParam) {
+    // The column for each param that we're solving for; any other param
+    // that appears in an equation is just a constant here.
+    std::unordered_map<uint32_t, int> column;
+
+    m->param.clear();
+    m->parp.clear();
+    m->scale.clear();
+    for(int a : b.param) {
+        Param *p = &(param.elem[a]);
+        column[p->h.v] = (int)m->param.size();
+        m->param.push_back(p->h);
+        m->parp.push_back(p);
+        if(IsDragged(p->h)) {
+            // It's least squares, so this parameter doesn't need to be all
+            // that big to get a large effect.
+            m->scale.push_back(1/20.0);
+        } else {
+            m->scale.push_back(1);
+        }
+    }
+    m->n = (int)m->param.size();
+    m->differentiation = differentiation;
+    m->method = method;
+    m->quasiNewton = (dragged.n > 0);
+    m->haveJacobian = false;
+    m->damping = 0;
+
+    m->eq.clear();
+    m->A.row.clear();
+    m->A.col.clear();
+    m->A.sym.clear();
+    m->A.tape.Clear();
+    m->A.grad.clear();
+    m->B.sym.clear();
+    m->B.tape.Clear();
+
+    std::vector<hParam> paramsUsed;
+    std::vector<std::pair<int, Expr *>> partials;
+    std::vector<std::pair<int, int>> grads;
+
+    for(int a : b.eq) {
         Equation *e = &(eq.elem[a]);
-        if(e->tag != tag) continue;
 
-        mat.eq[i] = e->h;
-        Expr *f = e->e->DeepCopyWithParamsAsPointers(&param, &(SK.param));
+        m->eq.push_back(e->h);
+        Expr *f = e->e->DeepCopyWithParamsAsPointers(&param, &dimension,
+                                                     sketchParam);
         f = f->FoldConstants();
 
-        // Hash table (61 bits) to accelerate generation of zero partials.
-        uint64_t scoreboard = f->ParamsUsed();
-        for(j = 0; j < mat.n; j++) {
-            Expr *pd;
-            if(scoreboard & ((uint64_t)1 << (mat.param[j].v % 61)) &&
-                f->DependsOn(mat.param[j]))
-            {
-                pd = f->PartialWrt(mat.param[j]);
-                pd = pd->FoldConstants();
-                pd = pd->DeepCopyWithParamsAsPointers(&param, &(SK.param));
-            } else {
-                pd = Expr::From(0.0);
+        if(differentiation == Differentiation::AUTOMATIC) {
+            // Each param that the compiled equation loads gets an entry in
+            // the gradient, so that's our sparsity pattern.
+            m->B.sym.push_back(f);
+            m->B.tape.CompileWithGradient(f);
+
+            const ExprTape::Gradient &g = m->B.tape.gradients.back();
+            grads.clear();
+            for(int i = g.params; i < g.paramsEnd; i++) {
+                Param *p = m->B.tape.params[m->B.tape.gradParams[i]].second;
+                auto it = column.find(p->h.v);
+                if(it == column.end()) continue;
+                grads.emplace_back(it->second, i);
+            }
+            std::sort(grads.begin(), grads.end());
+
+            m->A.row.push_back((int)m->A.col.size());
+            for(const auto &gr : grads) {
+                m->A.col.push_back(gr.first);
+                m->A.grad.push_back(gr.second);
             }
-            mat.A.sym[i][j] = pd;
+            continue;
         }
-        mat.B.sym[i] = f;
-        i++;
-    }
-    mat.m = i;
 
-    return true;
+        // Only the params that actually appear in the equation can have
+        // a nonzero partial, so don't bother with any others. The copy
+        // points at its params already, and so do its partials.
+        paramsUsed.clear();
+        f->ParamsUsedList(&paramsUsed);
+        std::sort(paramsUsed.begin(), paramsUsed.end(),
+            [](const hParam &pa, const hParam &pb) { return pa.v < pb.v; });
+        paramsUsed.erase(std::unique(paramsUsed.begin(), paramsUsed.end(),
+            [](const hParam &pa, const hParam &pb) { return pa.v == pb.v; }),
+            paramsUsed.end());
+
+        partials.clear();
+        for(hParam hp : paramsUsed) {
+            auto it = column.find(hp.v);
+            if(it == column.end()) continue;
+
+            Expr *pd = f->PartialWrt(hp);
+            pd = pd->FoldConstants();
+            if(pd->op == Expr::Op::CONSTANT && pd->v == 0.0) continue;
+            partials.emplace_back(it->second, pd);
+        }
+        std::sort(partials.begin(), partials.end(),
+            [](const std::pair<int, Expr *> &pa, const std::pair<int, Expr *> &pb) {
+                return pa.first < pb.first;
+            });
+
+        m->A.row.push_back((int)m->A.col.size());
+        for(const auto &pd : partials) {
+            m->A.col.push_back(pd.first);
+            m->A.sym.push_back(pd.second);
+            m->A.tape.Compile(pd.second);
+        }
+        m->B.sym.push_back(f);
+        m->B.tape.Compile(f);
+    }
+    m->m = (int)m->eq.size();
+    m->A.row.push_back((int)m->A.col.size());
+    m->A.num.resize(m->A.col.size());
+    m->A.gradient.resize(m->B.tape.gradParams.size());
+
+    m->B.num.resize(m->m);
+    m->Z.resize(m->m);
+    m->X.resize(m->n);
 }
 
-void System::EvalJacobian() {
-    int i, j;
-    for(i = 0; i < mat.m; i++) {
-        for(j = 0; j < mat.n; j++) {
-            mat.A.num[i][j] = (mat.A.sym[i][j])->Eval();
+void System::Matrix::EvalJacobian() {
+    if(differentiation == Differentiation::AUTOMATIC) {
+        B.tape.EvalWithGradient(NULL, A.gradient.data());
+        for(size_t k = 0; k < A.grad.size(); k++) {
+            A.num[k] = A.gradient[A.grad[k]];
         }
+    } else {
+        A.tape.Eval(A.num.data());
     }
+    haveJacobian = true;
+}
+
+void System::Matrix::EvalFunctions() {
+    B.tape.Eval(B.num.data());
 }
 
 bool System::IsDragged(hParam p) {
@@ -84,8 +390,27 @@ bool System::IsDragged(hParam p) {
     return false;
 }
 
+//-----------------------------------------------------------------------------
+// Eliminate the params that are simply equal to some other param. We find the
+// classes of equal params with a union-find, and substitute each class's
+// representative for the rest of the class, in all the equations at once.
+// If a dragged param is in a class, then it's the one that stays.
+//-----------------------------------------------------------------------------
 void System::SolveBySubstitution() {
     int i;
+    std::vector<int> parent(param.n);
+    for(i = 0; i < param.n; i++) {
+        parent[i] = i;
+    }
+    auto find = [&](int a) {
+        while(parent[a] != a) {
+            parent[a] = parent[parent[a]];
+            a = parent[a];
+        }
+        return a;
+    };
+
+    bool any = false;
     for(i = 0; i < eq.n; i++) {
         Equation *teq = &(eq.elem[i]);
         Expr *tex = teq->e;
@@ -94,126 +419,606 @@ void System::SolveBySubstitution() {
            tex->a->op == Expr::Op::PARAM &&
            tex->b->op == Expr::Op::PARAM)
         {
-            hParam a = tex->a->parh;
-            hParam b = tex->b->parh;
-            if(!(param.FindByIdNoOops(a) && param.FindByIdNoOops(b))) {
+            Param *pa = param.FindByIdNoOops(tex->a->parh);
+            Param *pb = param.FindByIdNoOops(tex->b->parh);
+            if(!(pa && pb)) {
                 // Don't substitute unless they're both solver params;
                 // otherwise it's an equation that can be solved immediately,
                 // or an error to flag later.
                 continue;
             }
 
-            if(IsDragged(a)) {
-                // A is being dragged, so A should stay, and B should go
-                hParam t = a;
-                a = b;
-                b = t;
+            int a = find((int)(pa - param.elem)),
+                b = find((int)(pb - param.elem));
+            if(a != b) {
+                if(IsDragged(param.elem[a].h)) {
+                    // A is being dragged, so A should stay, and B should go
+                    std::swap(a, b);
+                }
+                parent[a] = b; // A becomes B, B unchanged
             }
+            // If they were equal already, then this equation is redundant;
+            // it's satisfied once we substitute.
+            teq->tag = EQ_SUBSTITUTED;
+            any = true;
+        }
+    }
+    if(!any) return;
+
+    std::unordered_map<uint32_t, hParam> subst;
+    for(i = 0; i < param.n; i++) {
+        int r = find(i);
+        if(r == i) continue;
+        Param *p = &(param.elem[i]);
+        p->tag = VAR_SUBSTITUTED;
+        p->substd = param.elem[r].h;
+        subst[p->h.v] = p->substd;
+    }
+    for(i = 0; i < eq.n; i++) {
+        Equation *req = &(eq.elem[i]);
+        req->e = (req->e)->Substitute(subst);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Split the equations that are left to solve in to blocks that can be solved
+// one at a time. We find a maximum matching between equations and the params
+// that they use, and from that the Dulmage-Mendelsohn decomposition: the
+// over- and underdetermined parts, and a well-determined part, whose strongly
+// connected components are square blocks in block triangular order. Each
+// block uses only its own params and those of the blocks before it, or of
+// the overdetermined part; those other params are listed in uses. Equations
+// in the over- or underdetermined parts aren't in any block.
+//-----------------------------------------------------------------------------
+void System::FindBlocks(std::vector<Block> *blocks) {
+    int i, j, k;
+
+    // Number the equations and params that are left, and find the params
+    // that each equation uses, as a sparse adjacency list.
+    std::vector<int> eqs, params, paramIndex(param.n, -1);
+    for(i = 0; i < param.n; i++) {
+        if(param.elem[i].tag != 0) continue;
+        paramIndex[i] = (int)params.size();
+        params.push_back(i);
+    }
+    std::vector<int> adjStart, adj;
+    std::vector<hParam> used;
+    for(i = 0; i < eq.n; i++) {
+        Equation *e = &(eq.elem[i]);
+        if(e->tag != 0) continue;
+        eqs.push_back(i);
+        adjStart.push_back((int)adj.size());
+
+        used.clear();
+        e->e->ParamsUsedList(&used);
+        int first = (int)adj.size();
+        for(hParam hp : used) {
+            Param *p = param.FindByIdNoOops(hp);
+            if(!p || paramIndex[p - param.elem] < 0) continue;
+            adj.push_back(paramIndex[p - param.elem]);
+        }
+        std::sort(adj.begin() + first, adj.end());
+        adj.erase(std::unique(adj.begin() + first, adj.end()), adj.end());
+    }
+    adjStart.push_back((int)adj.size());
+    int m = (int)eqs.size(), n = (int)params.size();
+
+    // And the transpose, the equations that use each param.
+    std::vector<int> tadjStart(n + 1, 0), tadj(adj.size());
+    for(int c : adj) tadjStart[c + 1]++;
+    for(j = 0; j < n; j++) tadjStart[j + 1] += tadjStart[j];
+    std::vector<int> fill(tadjStart.begin(), tadjStart.end() - 1);
+    for(i = 0; i < m; i++) {
+        for(k = adjStart[i]; k < adjStart[i + 1]; k++) {
+            tadj[fill[adj[k]]++] = i;
+        }
+    }
 
-            int j;
-            for(j = 0; j < eq.n; j++) {
-                Equation *req = &(eq.elem[j]);
-                (req->e)->Substitute(a, b); // A becomes B, B unchanged
+    // A maximum matching, by augmenting paths; start from a greedy matching,
+    // which usually leaves little for the search to do.
+    std::vector<int> matchEq(m, -1), matchParam(n, -1);
+    for(i = 0; i < m; i++) {
+        for(k = adjStart[i]; k < adjStart[i + 1]; k++) {
+            if(matchParam[adj[k]] < 0) {
+                matchEq[i] = adj[k];
+                matchParam[adj[k]] = i;
+                break;
+            }
+        }
+    }
+    std::vector<int> visited(n, -1), next(m), stack;
+    for(int root = 0; root < m; root++) {
+        if(matchEq[root] >= 0) continue;
+
+        // Depth-first, along edges from an equation to a param that's
+        // either unmatched (and we're done) or matched to the next equation.
+        stack.clear();
+        stack.push_back(root);
+        next[root] = adjStart[root];
+        while(!stack.empty()) {
+            int e = stack.back();
+            if(next[e] == adjStart[e + 1]) {
+                stack.pop_back();
+                continue;
             }
-            for(j = 0; j < param.n; j++) {
-                Param *rp = &(param.elem[j]);
-                if(rp->substd.v == a.v) {
-                    rp->substd = b;
+            int p = adj[next[e]++];
+            if(visited[p] == root) continue;
+            visited[p] = root;
+
+            if(matchParam[p] < 0) {
+                // Found an augmenting path, so flip it.
+                // Each equation on the stack gets the param that we last
+                // followed from it.
+                for(int es : stack) {
+                    int ps = adj[next[es] - 1];
+                    matchEq[es] = ps;
+                    matchParam[ps] = es;
                 }
+                break;
             }
-            Param *ptr = param.FindById(a);
-            ptr->tag = VAR_SUBSTITUTED;
-            ptr->substd = b;
+            int ep = matchParam[p];
+            next[ep] = adjStart[ep];
+            stack.push_back(ep);
+        }
+    }
 
-            teq->tag = EQ_SUBSTITUTED;
+    // Anything reachable by an alternating path from an unmatched equation
+    // is overdetermined, and from an unmatched param underdetermined.
+    std::vector<bool> eqAside(m, false), paramAside(n, false);
+    std::vector<int> queue;
+    for(i = 0; i < m; i++) {
+        if(matchEq[i] >= 0) continue;
+        eqAside[i] = true;
+        queue.push_back(i);
+    }
+    while(!queue.empty()) {
+        int e = queue.back();
+        queue.pop_back();
+        for(k = adjStart[e]; k < adjStart[e + 1]; k++) {
+            int p = adj[k];
+            if(paramAside[p]) continue;
+            paramAside[p] = true;
+            int ep = matchParam[p];
+            if(ep >= 0 && !eqAside[ep]) {
+                eqAside[ep] = true;
+                queue.push_back(ep);
+            }
+        }
+    }
+    for(j = 0; j < n; j++) {
+        if(matchParam[j] >= 0 || paramAside[j]) continue;
+        paramAside[j] = true;
+        queue.push_back(j);
+    }
+    while(!queue.empty()) {
+        int p = queue.back();
+        queue.pop_back();
+        for(k = tadjStart[p]; k < tadjStart[p + 1]; k++) {
+            int e = tadj[k];
+            if(eqAside[e]) continue;
+            eqAside[e] = true;
+            int pe = matchEq[e];
+            if(pe >= 0 && !paramAside[pe]) {
+                paramAside[pe] = true;
+                queue.push_back(pe);
+            }
+        }
+    }
+
+    // The rest is square, and its blocks are the strongly connected
+    // components of the graph with an edge from each equation to the
+    // equation matched to each param that it uses (Tarjan). A component is
+    // finished only after everything that it depends on, so that's the
+    // order to solve them in.
+    std::vector<int> index(m, -1), low(m), component, inBlock(n, -1);
+    std::vector<bool> onComponent(m, false);
+    int counter = 0;
+    for(int root = 0; root < m; root++) {
+        if(eqAside[root] || index[root] >= 0) continue;
+
+        stack.clear();
+        stack.push_back(root);
+        index[root] = low[root] = counter++;
+        next[root] = adjStart[root];
+        component.push_back(root);
+        onComponent[root] = true;
+        while(!stack.empty()) {
+            int e = stack.back();
+            if(next[e] < adjStart[e + 1]) {
+                int p = adj[next[e]++];
+                int f = matchParam[p];
+                if(p == matchEq[e] || f < 0 || eqAside[f]) continue;
+                if(index[f] < 0) {
+                    index[f] = low[f] = counter++;
+                    next[f] = adjStart[f];
+                    component.push_back(f);
+                    onComponent[f] = true;
+                    stack.push_back(f);
+                } else if(onComponent[f]) {
+                    low[e] = std::min(low[e], index[f]);
+                }
+                continue;
+            }
+
+            stack.pop_back();
+            if(!stack.empty()) {
+                int parent = stack.back();
+                low[parent] = std::min(low[parent], low[e]);
+            }
+            if(low[e] != index[e]) continue;
+
+            Block b;
+            int f, first = (int)component.size();
+            do {
+                f = component[--first];
+                onComponent[f] = false;
+                b.eq.push_back(eqs[f]);
+                b.param.push_back(params[matchEq[f]]);
+                inBlock[matchEq[f]] = (int)blocks->size();
+            } while(f != e);
+
+            for(int c = first; c < (int)component.size(); c++) {
+                for(k = adjStart[component[c]]; k < adjStart[component[c] + 1]; k++) {
+                    if(inBlock[adj[k]] == (int)blocks->size()) continue;
+                    b.uses.push_back(params[adj[k]]);
+                }
+            }
+            component.resize(first);
+            std::sort(b.uses.begin(), b.uses.end());
+            b.uses.erase(std::unique(b.uses.begin(), b.uses.end()), b.uses.end());
+            blocks->push_back(b);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Solve each block that we can by itself, and mark its equations and params
+// as solved. A block is solved only after all the blocks that it depends on,
+// but the ones that don't depend on each other are independent, so if there
+// are enough of them then we solve them on several threads. Each thread
+// writes the equations of the blocks that it takes, in to a temporary arena
+// of its own, which we adopt at the end so the matrices that we keep stay
+// good; solving a block touches only its own matrix and the values of its
+// own params. If a block fails to converge, then we return false, with its
+// matrix in mat.
+//-----------------------------------------------------------------------------
+bool System::SolveBlocks(const std::vector<Block> &blocks, Compiled *cache) {
+    enum { SOLVED, LEFT, FAILED };
+    int nb = (int)blocks.size();
+    int i;
+
+    // A block that uses params that aren't in any block must be left for
+    // the big system; otherwise it waits for the blocks that it uses.
+    std::vector<int> paramBlock(param.n, -1);
+    for(i = 0; i < nb; i++) {
+        for(int j : blocks[i].param) paramBlock[j] = i;
+    }
+    std::vector<int> waiting(nb, 0), result(nb, SOLVED), ready;
+    std::vector<std::vector<int>> dependents(nb);
+    std::vector<Matrix> matrices(nb);
+    cache->blocks.resize(nb);
+    for(i = 0; i < nb; i++) {
+        for(int j : blocks[i].uses) {
+            if(paramBlock[j] >= 0) {
+                dependents[paramBlock[j]].push_back(i);
+                waiting[i]++;
+            } else if(param.elem[j].tag == 0) {
+                result[i] = LEFT;
+            }
+        }
+        if(waiting[i] == 0) ready.push_back(i);
+    }
+
+    int threads = std::min((int)std::thread::hardware_concurrency(),
+                           nb / BLOCKS_PER_THREAD);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int finished = 0;
+    // One for each thread that joins in, if there's more than us.
+    std::deque<TemporaryArena> arenas;
+    ParamList *sketchParam = &(SK.param);
+    std::function<void()> work = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        ExprTable table;
+        std::unique_ptr<TemporaryArena::Scope> arenaScope;
+        std::unique_ptr<ExprTable::Scope> tableScope;
+        if(threads > 1) {
+            arenas.emplace_back();
+            arenaScope.reset(new TemporaryArena::Scope(&arenas.back()));
+            tableScope.reset(new ExprTable::Scope(&table));
+        }
+        while(finished < nb) {
+            if(ready.empty()) {
+                cv.wait(lock);
+                continue;
+            }
+            int b = ready.back();
+            ready.pop_back();
+            int r = result[b];
+            lock.unlock();
+
+            if(r != LEFT) {
+                WriteJacobian(blocks[b], &matrices[b], &cache->blocks[b],
+                              sketchParam);
+            }
+            // Unless it converges from where we left off while dragging, a
+            // block that's singular here gets left for the big system, and
+            // so does anything that depends on it.
+            if(r != LEFT && !matrices[b].NewtonSolveFromLast()) {
+                Matrix *m = &matrices[b];
+                if(!m->TestRank()) {
+                    r = LEFT;
+                } else if(!m->NewtonSolve()) {
+                    r = FAILED;
+                }
+            }
+
+            lock.lock();
+            result[b] = r;
+            finished++;
+            for(int d : dependents[b]) {
+                if(r != SOLVED) result[d] = LEFT;
+                if(--waiting[d] == 0) ready.push_back(d);
+            }
+            cv.notify_all();
+        }
+    };
+
+    if(threads > 1) {
+        SolveWorkers::Get()->Run(threads - 1, work);
+        for(TemporaryArena &arena : arenas) {
+            AdoptTemporary(&arena);
+        }
+    } else {
+        work();
+    }
+
+    for(i = 0; i < nb; i++) {
+        if(result[i] == FAILED) {
+            std::swap(mat, matrices[i]);
+            return false;
         }
     }
+    for(i = 0; i < nb; i++) {
+        if(result[i] != SOLVED) continue;
+        KeepJacobian(matrices[i], &cache->blocks[i]);
+        for(int j : blocks[i].eq)    eq.elem[j].tag = EQ_SOLVED_IN_BLOCK;
+        for(int j : blocks[i].param) param.elem[j].tag = VAR_SOLVED_IN_BLOCK;
+    }
+    return true;
 }
 
 //-----------------------------------------------------------------------------
-// Calculate the rank of the Jacobian matrix, by Gram-Schimdt orthogonalization
-// in place. A row (~equation) is considered to be all zeros if its magnitude
-// is less than the tolerance RANK_MAG_TOLERANCE.
+// Calculate the rank of the Jacobian matrix, by a sparse Householder QR
+// factorization of its transpose, with column pivoting; so each step takes
+// the row (~equation) that's furthest from the span of the rows taken so far,
+// and reflects it on to one of its coordinates. What's left of each other row
+// outside the coordinates used so far is then its component normal to those
+// rows. We stop when every row that's left has a magnitude less than the
+// tolerance RANK_MAG_TOLERANCE, and the rank is the number of rows taken.
+//
+// If free is given, then we also carry along a unit vector for each column,
+// as a row that's never taken. Whatever's left of it at the end is its
+// component normal to the row space; and if that's not zero, then the column
+// could be removed without losing rank, so that param is free.
 //-----------------------------------------------------------------------------
-int System::CalculateRank() {
+int System::Matrix::CalculateRank(std::vector<bool> *free) {
     // Actually work with magnitudes squared, not the magnitudes
-    double rowMag[MAX_UNKNOWNS] = {};
     double tol = RANK_MAG_TOLERANCE*RANK_MAG_TOLERANCE;
 
-    int i, iprev, j;
-    int rank = 0;
+    // What's left of each row, and its magnitude; and for each column, the
+    // rows that might have an entry in it.
+    int total = free ? m + n : m;
+    std::vector<SparseRow> rows(total);
+    std::vector<double> rowMag(total, 0.0);
+    std::vector<int> version(total, 0);
+    std::vector<bool> taken(total, false);
+    std::vector<std::vector<int>> colRows(n);
+
+    qr.pivot.clear();
+    qr.R.assign(m, SparseRow());
+
+    // The rows by magnitude; an entry is stale if that row's changed since.
+    typedef std::pair<double, std::pair<int, int>> HeapEntry;
+    std::priority_queue<HeapEntry> heap;
+
+    int i, k;
+    for(i = 0; i < m; i++) {
+        for(k = A.row[i]; k < A.row[i+1]; k++) {
+            if(A.num[k] == 0.0) continue;
+            rows[i].emplace_back(A.col[k], A.num[k]);
+            colRows[A.col[k]].push_back(i);
+            rowMag[i] += A.num[k]*A.num[k];
+        }
+        heap.push({ rowMag[i], { i, 0 } });
+    }
+    if(free) {
+        for(k = 0; k < n; k++) {
+            rows[m+k].emplace_back(k, 1.0);
+            colRows[k].push_back(m+k);
+            rowMag[m+k] = 1.0;
+        }
+    }
 
-    for(i = 0; i < mat.m; i++) {
-        // Subtract off this row's component in the direction of any
-        // previous rows
-        for(iprev = 0; iprev < i; iprev++) {
-            if(rowMag[iprev] <= tol) continue; // ignore zero rows
+    // The Householder vector, scattered into a dense vector; and the same
+    // for each row that we reflect.
+    std::vector<double> v(n, 0.0), work(n, 0.0);
+    std::vector<bool> inWork(n, false), used(n, false);
+    std::vector<int> touched, support, mark(total, -1);
 
+    int rank = 0;
+    while(!heap.empty()) {
+        HeapEntry top = heap.top();
+        heap.pop();
+        int p = top.second.first;
+        if(taken[p] || top.second.second != version[p]) continue;
+        if(rowMag[p] <= tol) break;
+        taken[p] = true;
+        qr.pivot.push_back(p);
+        rank++;
+
+        // Reflect row p on to its biggest coordinate q.
+        const SparseRow &rp = rows[p];
+        int q = -1;
+        for(const auto &e : rp) {
+            if(q < 0 || ffabs(e.second) > ffabs(v[q])) q = e.first;
+            v[e.first] = e.second;
+        }
+        double mag = sqrt(rowMag[p]);
+        double vq = v[q];
+        double alpha = (vq > 0) ? -mag : mag;
+        v[q] = vq - alpha;
+        double vv = 2*mag*(mag + ffabs(vq));
+        used[q] = true;
+        qr.R[p].emplace_back(rank - 1, alpha);
+
+        // And apply that reflection to every other row that shares a
+        // coordinate with it.
+        touched.clear();
+        for(const auto &e : rp) {
+            for(int r : colRows[e.first]) {
+                if(taken[r] || mark[r] == p) continue;
+                mark[r] = p;
+                touched.push_back(r);
+            }
+        }
+        for(int r : touched) {
             double dot = 0;
-            for(j = 0; j < mat.n; j++) {
-                dot += (mat.A.num[iprev][j]) * (mat.A.num[i][j]);
+            for(const auto &e : rows[r]) dot += v[e.first]*e.second;
+            double f = 2*dot/vv;
+
+            support.clear();
+            for(const auto &e : rows[r]) {
+                work[e.first] = e.second;
+                inWork[e.first] = true;
+                support.push_back(e.first);
             }
-            for(j = 0; j < mat.n; j++) {
-                mat.A.num[i][j] -= (dot/rowMag[iprev])*mat.A.num[iprev][j];
+            for(const auto &e : rp) {
+                if(!inWork[e.first]) {
+                    inWork[e.first] = true;
+                    support.push_back(e.first);
+                    colRows[e.first].push_back(r);
+                }
+                work[e.first] -= f*v[e.first];
             }
+
+            // The coordinate q is used now, so it's no longer part of
+            // what's left of the row; it's the row's entry in R.
+            if(r < m && work[q] != 0.0) qr.R[r].emplace_back(rank - 1, work[q]);
+            rows[r].clear();
+            rowMag[r] = 0;
+            for(int j : support) {
+                if(!used[j] && work[j] != 0.0) {
+                    rows[r].emplace_back(j, work[j]);
+                    rowMag[r] += work[j]*work[j];
+                }
+                work[j] = 0;
+                inWork[j] = false;
+            }
+            version[r]++;
+            if(r < m) heap.push({ rowMag[r], { r, version[r] } });
         }
-        // Our row is now normal to all previous rows; calculate the
-        // magnitude of what's left
-        double mag = 0;
-        for(j = 0; j < mat.n; j++) {
-            mag += (mat.A.num[i][j]) * (mat.A.num[i][j]);
-        }
-        if(mag > tol) {
-            rank++;
-        }
-        rowMag[i] = mag;
+        for(const auto &e : rp) v[e.first] = 0;
     }
 
+    if(free) {
+        free->assign(n, false);
+        for(k = 0; k < n; k++) {
+            (*free)[k] = (rowMag[m+k] > tol);
+        }
+    }
     return rank;
 }
 
-bool System::TestRank() {
+//-----------------------------------------------------------------------------
+// From the factorization that CalculateRank() left, find a basis for the left
+// null space of A. Each row that wasn't taken is (within our tolerance) a
+// combination of the rows that were, since its entries in R are the R of
+// those rows times the coefficients; so we find them by back-substitution,
+// and that row minus the combination is zero.
+//-----------------------------------------------------------------------------
+void System::Matrix::FindLeftNullSpace(std::vector<SparseRow> *nullSpace) {
+    int rank = (int)qr.pivot.size();
+    std::vector<bool> taken(m, false);
+    for(int p : qr.pivot) taken[p] = true;
+
+    std::vector<double> b(rank, 0.0);
+    for(int j = 0; j < m; j++) {
+        if(taken[j]) continue;
+
+        for(const auto &e : qr.R[j]) b[e.first] = e.second;
+        SparseRow y;
+        y.emplace_back(j, 1.0);
+        for(int l = rank - 1; l >= 0; l--) {
+            if(b[l] == 0.0) continue;
+            // The row taken at step l has its diagonal entry last.
+            const SparseRow &col = qr.R[qr.pivot[l]];
+            double c = b[l]/col.back().second;
+            b[l] = 0;
+            for(size_t k = 0; k + 1 < col.size(); k++) {
+                b[col[k].first] -= c*col[k].second;
+            }
+            y.emplace_back(qr.pivot[l], -c);
+        }
+        nullSpace->push_back(y);
+    }
+}
+
+bool System::Matrix::TestRank() {
     EvalJacobian();
-    return CalculateRank() == mat.m;
+    return CalculateRank() == m;
 }
 
-bool System::SolveLinearSystem(double X[], double A[][MAX_UNKNOWNS],
+bool System::SolveLinearSystem(double X[], std::vector<SparseRow> *pA,
                                double B[], int n)
 {
-    // Gaussian elimination, with partial pivoting. It's an error if the
-    // matrix is singular, because that means two constraints are
-    // equivalent.
-    int i, j, ip, jp, imax = 0;
-    double max, temp;
+    // Gaussian elimination, on a symmetric positive semidefinite matrix
+    // of which only the upper triangle is stored, with each row sorted by
+    // column. For such a matrix we can always pivot on the diagonal, so the
+    // rows never need to be swapped, and eliminating the term in column i
+    // only touches the rows that row i has an entry in.
+    std::vector<SparseRow> &A = *pA;
+    SparseRow merged;
+    int i, k;
+    double temp;
+    bool singular = false;
 
     for(i = 0; i < n; i++) {
-        // We are trying eliminate the term in column i, for rows i+1 and
-        // greater. First, find a pivot (between rows i and N-1).
-        max = 0;
-        for(ip = i; ip < n; ip++) {
-            if(ffabs(A[ip][i]) > max) {
-                imax = ip;
-                max = ffabs(A[ip][i]);
-            }
-        }
-        // Don't give up on a singular matrix unless it's really bad; the
-        // assumption code is responsible for identifying that condition,
-        // so we're not responsible for reporting that error.
-        if(ffabs(max) < 1e-20) continue;
-
-        // Swap row imax with row i
-        for(jp = 0; jp < n; jp++) {
-            swap(A[i][jp], A[imax][jp]);
+        SparseRow &ri = A[i];
+        // Don't give up on a singular matrix; the assumption code is
+        // responsible for identifying that condition, so we still find the
+        // best solution that we can, with zero for the unknowns that we
+        // can't pivot on. But return false, since a caller that could get
+        // a better matrix should.
+        if(ri.empty() || ri[0].first != i || ffabs(ri[0].second) < 1e-20) {
+            singular = true;
+            continue;
         }
-        swap(B[i], B[imax]);
-
-        // For rows i+1 and greater, eliminate the term in column i.
-        for(ip = i+1; ip < n; ip++) {
-            temp = A[ip][i]/A[i][i];
 
-            for(jp = i; jp < n; jp++) {
-                A[ip][jp] -= temp*(A[i][jp]);
+        for(k = 1; k < (int)ri.size(); k++) {
+            int ip = ri[k].first;
+            temp = ri[k].second/ri[0].second;
+
+            // For row ip, eliminate the term in column i; the rest of row i
+            // from column ip onwards gets subtracted off.
+            SparseRow &rp = A[ip];
+            merged.clear();
+            auto pa = rp.begin();
+            auto pb = ri.begin() + k;
+            while(pa != rp.end() || pb != ri.end()) {
+                if(pb == ri.end() || (pa != rp.end() && pa->first < pb->first)) {
+                    merged.push_back(*pa++);
+                } else if(pa == rp.end() || pb->first < pa->first) {
+                    merged.emplace_back(pb->first, -temp*pb->second);
+                    pb++;
+                } else {
+                    merged.emplace_back(pa->first, pa->second - temp*pb->second);
+                    pa++;
+                    pb++;
+                }
             }
+            rp.swap(merged);
             B[ip] -= temp*B[i];
         }
     }
@@ -221,82 +1026,137 @@ bool System::SolveLinearSystem(double X[], double A[][MAX_UNKNOWNS],
     // We've put the matrix in upper triangular form, so at this point we
     // can solve by back-substitution.
     for(i = n - 1; i >= 0; i--) {
-        if(ffabs(A[i][i]) < 1e-20) continue;
+        SparseRow &ri = A[i];
+        if(ri.empty() || ri[0].first != i || ffabs(ri[0].second) < 1e-20) {
+            X[i] = 0;
+            continue;
+        }
 
         temp = B[i];
-        for(j = n - 1; j > i; j--) {
-            temp -= X[j]*A[i][j];
+        for(k = 1; k < (int)ri.size(); k++) {
+            temp -= X[ri[k].first]*ri[k].second;
         }
-        X[i] = temp / A[i][i];
+        X[i] = temp / ri[0].second;
     }
 
-    return true;
+    return !singular;
 }
 
-bool System::SolveLeastSquares() {
-    int r, c, i;
+bool System::Matrix::SolveLeastSquares() {
+    int r, c, k;
 
-    // Scale the columns; this scale weights the parameters for the least
-    // squares solve, so that we can encourage the solver to make bigger
-    // changes in some parameters, and smaller in others.
-    for(c = 0; c < mat.n; c++) {
-        if(IsDragged(mat.param[c])) {
-            // It's least squares, so this parameter doesn't need to be all
-            // that big to get a large effect.
-            mat.scale[c] = 1/20.0;
-        } else {
-            mat.scale[c] = 1;
-        }
-        for(r = 0; r < mat.m; r++) {
-            mat.A.num[r][c] *= mat.scale[c];
+    // Scale the columns, so that we can encourage the solver to make bigger
+    // changes in some parameters, and smaller in others. The Jacobian itself
+    // is left as it was, since we might update it and solve again.
+    std::vector<double> As(A.num.size());
+    for(k = 0; k < (int)A.num.size(); k++) {
+        As[k] = A.num[k]*scale[A.col[k]];
+    }
+
+    // Find the nonzero entries of each column, since two rows can only
+    // have a nonzero product if they share a column.
+    std::vector<std::vector<std::pair<int, double>>> colEntries(n);
+    for(r = 0; r < m; r++) {
+        for(k = A.row[r]; k < A.row[r+1]; k++) {
+            colEntries[A.col[k]].emplace_back(r, As[k]);
         }
     }
 
-    // Write A*A'
-    for(r = 0; r < mat.m; r++) {
-        for(c = 0; c < mat.m; c++) {  // yes, AAt is square
-            double sum = 0;
-            for(i = 0; i < mat.n; i++) {
-                sum += mat.A.num[r][i]*mat.A.num[c][i];
+    // Write A*A', of which we need only the upper triangle, since it's
+    // symmetric.
+    std::vector<double> sum(m, 0.0);
+    std::vector<bool> inSum(m, false);
+    std::vector<int> nonzero;
+    AAt.resize(m);
+    for(r = 0; r < m; r++) {
+        nonzero.clear();
+        for(k = A.row[r]; k < A.row[r+1]; k++) {
+            for(const auto &e : colEntries[A.col[k]]) {
+                if(e.first < r) continue;
+                if(!inSum[e.first]) {
+                    inSum[e.first] = true;
+                    nonzero.push_back(e.first);
+                }
+                sum[e.first] += As[k]*e.second;
             }
-            mat.AAt[r][c] = sum;
+        }
+        std::sort(nonzero.begin(), nonzero.end());
+
+        AAt[r].clear();
+        for(int rc : nonzero) {
+            AAt[r].emplace_back(rc, sum[rc]);
+            sum[rc] = 0;
+            inSum[rc] = false;
+        }
+        // The diagonal entry comes first, if the row isn't empty.
+        if(damping > 0 && !AAt[r].empty() && AAt[r][0].first == r) {
+            AAt[r][0].second *= 1 + damping;
         }
     }
 
-    if(!SolveLinearSystem(mat.Z, mat.AAt, mat.B.num, mat.m)) return false;
+    bool nonsingular = SolveLinearSystem(Z.data(), &AAt, B.num.data(), m);
 
     // And multiply that by A' to get our solution.
-    for(c = 0; c < mat.n; c++) {
-        double sum = 0;
-        for(i = 0; i < mat.m; i++) {
-            sum += mat.A.num[i][c]*mat.Z[i];
+    for(c = 0; c < n; c++) {
+        X[c] = 0;
+    }
+    for(r = 0; r < m; r++) {
+        for(k = A.row[r]; k < A.row[r+1]; k++) {
+            X[A.col[k]] += As[k]*Z[r];
         }
-        mat.X[c] = sum * mat.scale[c];
     }
-    return true;
+    for(c = 0; c < n; c++) {
+        X[c] *= scale[c];
+    }
+    return nonsingular;
 }
 
-bool System::NewtonSolve(int tag) {
+//-----------------------------------------------------------------------------
+// Solve by Newton's method. While dragging, the operating point moves only a
+// little between steps, so rather than evaluate the Jacobian every time, we
+// update the one that we have by Broyden's method (or rather Schubert's, which
+// keeps its sparsity): each row changes by the least change, within its own
+// nonzero entries, that makes it agree with the last step. If a step doesn't
+// reduce the residual by enough, then we evaluate the Jacobian afresh.
+//-----------------------------------------------------------------------------
+bool System::Matrix::NewtonSolve() {
+    if(method == Group::SolveMethod::DAMPED) return DampedSolve();
 
     int iter = 0;
     bool converged = false;
-    int i;
+    int i, k;
+
+    std::vector<double> residual;
+    auto norm = [&]() {
+        double sum = 0;
+        for(i = 0; i < m; i++) sum += B.num[i]*B.num[i];
+        return sum;
+    };
 
     // Evaluate the functions at our operating point.
-    for(i = 0; i < mat.m; i++) {
-        mat.B.num[i] = (mat.B.sym[i])->Eval();
-    }
+    EvalFunctions();
+    double f = norm();
     do {
-        // And evaluate the Jacobian at our initial operating point.
-        EvalJacobian();
-
-        if(!SolveLeastSquares()) break;
+        // And evaluate the Jacobian at our initial operating point, unless
+        // we already have it, or if our updates to it aren't good enough
+        // any more.
+        bool exact = !haveJacobian;
+        if(!haveJacobian) EvalJacobian();
+
+        if(!SolveLeastSquares() && quasiNewton && !exact) {
+            // That might just be our updates that are singular; so try
+            // again with the real thing. If that's singular too, then the
+            // least squares solution is still our best step.
+            EvalJacobian();
+            SolveLeastSquares();
+        }
+        if(!quasiNewton) haveJacobian = false;
 
         // Take the Newton step;
         //      J(x_n) (x_{n+1} - x_n) = 0 - F(x_n)
-        for(i = 0; i < mat.n; i++) {
-            Param *p = param.FindById(mat.param[i]);
-            p->val -= mat.X[i];
+        for(i = 0; i < n; i++) {
+            Param *p = parp[i];
+            p->val -= X[i];
             if(isnan(p->val)) {
                 // Very bad, and clearly not convergent
                 return false;
@@ -304,31 +1164,156 @@ bool System::NewtonSolve(int tag) {
         }
 
         // Re-evalute the functions, since the params have just changed.
-        for(i = 0; i < mat.m; i++) {
-            mat.B.num[i] = (mat.B.sym[i])->Eval();
-        }
+        if(quasiNewton) residual = B.num;
+        EvalFunctions();
         // Check for convergence
         converged = true;
-        for(i = 0; i < mat.m; i++) {
-            if(isnan(mat.B.num[i])) {
+        for(i = 0; i < m; i++) {
+            if(isnan(B.num[i])) {
                 return false;
             }
-            if(ffabs(mat.B.num[i]) > CONVERGE_TOLERANCE) {
+            if(ffabs(B.num[i]) > CONVERGE_TOLERANCE) {
                 converged = false;
                 break;
             }
         }
+
+        if(quasiNewton && !converged) {
+            double fn = norm();
+            if(fn > f*BROYDEN_MIN_REDUCTION) {
+                // Converging too slowly; start again from a fresh Jacobian.
+                haveJacobian = false;
+            } else {
+                // The step was -X, and the functions changed by
+                // B - residual; so update each row.
+                for(int r = 0; r < m; r++) {
+                    double predicted = 0, mag = 0;
+                    for(k = A.row[r]; k < A.row[r+1]; k++) {
+                        predicted -= A.num[k]*X[A.col[k]];
+                        mag += X[A.col[k]]*X[A.col[k]];
+                    }
+                    if(mag == 0.0) continue;
+                    double c = (B.num[r] - residual[r] - predicted)/mag;
+                    for(k = A.row[r]; k < A.row[r+1]; k++) {
+                        A.num[k] -= c*X[A.col[k]];
+                    }
+                }
+            }
+            f = fn;
+        }
     } while(iter++ < 50 && !converged);
 
     return converged;
 }
 
-void System::WriteEquationsExceptFor(hConstraint hc, Group *g) {
+//-----------------------------------------------------------------------------
+// While dragging, solve from the Jacobian that we kept from the last solve, if
+// we did; the operating point has moved only a little since then. If that
+// doesn't converge, then put the params back as they were, so that the caller
+// can test the rank and start again from scratch.
+//-----------------------------------------------------------------------------
+bool System::Matrix::NewtonSolveFromLast() {
+    if(!quasiNewton || !haveJacobian) return false;
+
+    std::vector<double> val(n);
+    int i;
+    for(i = 0; i < n; i++) val[i] = parp[i]->val;
+    if(NewtonSolve()) return true;
+
+    for(i = 0; i < n; i++) parp[i]->val = val[i];
+    haveJacobian = false;
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// Solve by Levenberg-Marquardt: each step is the least squares step with the
+// diagonal of A*A' scaled up by the damping, so that it's a Newton step when
+// that's small, and a short step down the gradient when it's big. We take a
+// step only if it reduces the residual; otherwise we go back and damp more,
+// and once a step works we damp less. So that's a trust region, and it can't
+// bounce around the way the full Newton steps might.
+//-----------------------------------------------------------------------------
+bool System::Matrix::DampedSolve() {
+    const double MIN_DAMPING = 1e-9, MAX_DAMPING = 1e9;
+
+    int iter = 0;
     int i;
+
+    std::vector<double> val(n), residual(m);
+    auto norm = [&]() {
+        double sum = 0;
+        for(i = 0; i < m; i++) sum += B.num[i]*B.num[i];
+        return sum;
+    };
+    auto converged = [&]() {
+        for(i = 0; i < m; i++) {
+            if(ffabs(B.num[i]) > CONVERGE_TOLERANCE) return false;
+        }
+        return true;
+    };
+
+    EvalFunctions();
+    double f = norm();
+    if(isnan(f)) return false;
+    if(converged()) return true;
+
+    damping = 1e-3;
+    while(iter++ < 50) {
+        for(i = 0; i < n; i++) val[i] = parp[i]->val;
+        residual = B.num;
+
+        EvalJacobian();
+        for(;;) {
+            // Even if A*A' is singular, the least squares solution is our
+            // best step; the damping will shorten it if need be.
+            SolveLeastSquares();
+            for(i = 0; i < n; i++) {
+                parp[i]->val = val[i] - X[i];
+            }
+            EvalFunctions();
+            double fn = norm();
+            if(!isnan(fn) && fn < f) {
+                f = fn;
+                break;
+            }
+            for(i = 0; i < n; i++) parp[i]->val = val[i];
+            B.num = residual;
+
+            damping *= 10;
+            if(damping > MAX_DAMPING) {
+                // No step reduces the residual, so we're stuck at a local
+                // minimum that's not a solution.
+                damping = 0;
+                return false;
+            }
+        }
+        if(converged()) break;
+        damping = std::max(damping/10, MIN_DAMPING);
+    }
+
+    damping = 0;
+    return converged();
+}
+
+void Sketch::IndexGroups() {
+    groupItems.clear();
+    for(const auto &r : request) {
+        groupItems[r.group.v].request.push_back(r.h);
+    }
+    for(const auto &c : constraint) {
+        groupItems[c.group.v].constraint.push_back(c.h);
+    }
+    for(const auto &e : entity) {
+        groupItems[e.group.v].entity.push_back(e.h);
+    }
+}
+
+void System::WriteEquationsExceptFor(hConstraint hc, Group *g) {
+    Sketch::GroupItems *items = SK.GetGroupItems(g->h);
+    dimension.Clear();
     // Generate all the equations from constraints in this group
-    for(i = 0; i < SK.constraint.n; i++) {
-        ConstraintBase *c = &(SK.constraint.elem[i]);
-        if(c->group.v != g->h.v) continue;
+    for(hConstraint ch : items->constraint) {
+        ConstraintBase *c = SK.GetConstraint(ch);
         if(c->h.v == hc.v) continue;
 
         if(c->HasLabel() && c->type != Constraint::Type::COMMENT &&
@@ -346,26 +1331,134 @@ void System::WriteEquationsExceptFor(hConstraint hc, Group *g) {
             continue;
         }
 
+        if(c->HasLabel() && c->type != Constraint::Type::COMMENT &&
+                !c->reference)
+        {
+            // Load the dimension from a param of its own, so that the
+            // equations don't depend on its value. Nothing else knows that
+            // param, so it's only for these equations; they're numbered in
+            // order, so the same equations get the same params next time.
+            Param p = {};
+            p.h.v   = DIMENSION_PARAM | (uint32_t)dimension.n;
+            p.known = true;
+            p.val   = c->valA;
+            dimension.Add(&p);
+
+            c->valP = p.h;
+            c->GenerateEquations(&eq);
+            c->valP.v = 0;
+            continue;
+        }
         c->GenerateEquations(&eq);
     }
     // And the equations from entities
-    for(i = 0; i < SK.entity.n; i++) {
-        EntityBase *e = &(SK.entity.elem[i]);
-        if(e->group.v != g->h.v) continue;
-
-        e->GenerateEquations(&eq);
+    for(hEntity he : items->entity) {
+        SK.GetEntity(he)->GenerateEquations(&eq);
     }
     // And from the groups themselves
     g->GenerateEquations(&eq);
 }
 
-void System::FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad, bool forceDofCheck) {
-    int a, i;
+//-----------------------------------------------------------------------------
+// Find the constraints that, if removed, would make the Jacobian full rank.
+// Rather than try removing each in turn, we factor the Jacobian once and find
+// its left null space, the combinations of equations that are dependent. Then
+// removing a constraint fixes it iff, for every such combination, some of its
+// equations take part: iff the null space restricted to its equations still
+// has full rank.
+//-----------------------------------------------------------------------------
+void System::FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad) {
+    int a, i, j, k;
+
+    // Substitution would make a constraint's equations disappear, so work
+    // with the whole system; but keep our tags, for the caller.
+    std::vector<int> tags(param.n);
+    for(i = 0; i < param.n; i++) {
+        tags[i] = param.elem[i].tag;
+    }
+    param.ClearTags();
+    eq.Clear();
+    WriteEquationsExceptFor(Constraint::NO_CONSTRAINT, g);
+    eq.ClearTags();
+    WriteJacobian(0);
+    for(i = 0; i < param.n; i++) {
+        param.elem[i].tag = tags[i];
+    }
+    mat.EvalJacobian();
+    mat.CalculateRank();
+
+    std::vector<SparseRow> nullSpace;
+    mat.FindLeftNullSpace(&nullSpace);
+    int d = (int)nullSpace.size();
+    if(d == 0) return;
+
+    // The rows written for each constraint
+    std::unordered_map<uint32_t, std::vector<int>> rowsOf;
+    size_t maxRows = 0;
+    for(i = 0; i < mat.m; i++) {
+        if(!mat.eq[i].isFromConstraint()) continue;
+        std::vector<int> &rows = rowsOf[mat.eq[i].constraint().v];
+        rows.push_back(i);
+        maxRows = std::max(maxRows, rows.size());
+    }
+    // A constraint with fewer equations than that can't fix all of them.
+    if((size_t)d > maxRows) return;
+
+    // Make the basis orthonormal, so that the tolerance means the same thing
+    // whatever the scale of the equations. Each vector has entries for just
+    // the rows that it combines, so keep them sparse, sorted by row.
+    auto dot = [](const SparseRow &ya, const SparseRow &yb) {
+        double r = 0;
+        auto pa = ya.begin(), pb = yb.begin();
+        while(pa != ya.end() && pb != yb.end()) {
+            if(pa->first < pb->first) {
+                pa++;
+            } else if(pb->first < pa->first) {
+                pb++;
+            } else {
+                r += (pa++)->second*(pb++)->second;
+            }
+        }
+        return r;
+    };
+    std::vector<SparseRow> basis(nullSpace);
+    SparseRow merged;
+    for(k = 0; k < d; k++) {
+        SparseRow &y = basis[k];
+        std::sort(y.begin(), y.end());
+        for(j = 0; j < k; j++) {
+            double f = dot(y, basis[j]);
+            if(f == 0.0) continue;
+
+            merged.clear();
+            auto pa = y.begin(), pb = basis[j].begin();
+            while(pa != y.end() || pb != basis[j].end()) {
+                if(pb == basis[j].end() || (pa != y.end() && pa->first < pb->first)) {
+                    merged.push_back(*pa++);
+                } else if(pa == y.end() || pb->first < pa->first) {
+                    merged.emplace_back(pb->first, -f*pb->second);
+                    pb++;
+                } else {
+                    merged.emplace_back(pa->first, pa->second - f*pb->second);
+                    pa++;
+                    pb++;
+                }
+            }
+            y.swap(merged);
+        }
+        double mag = sqrt(dot(y, y));
+        for(auto &e : y) e.second /= mag;
+    }
+    auto valueAt = [](const SparseRow &y, int row) {
+        auto it = std::lower_bound(y.begin(), y.end(), row,
+            [](const std::pair<int, double> &e, int r) { return e.first < r; });
+        return (it != y.end() && it->first == row) ? it->second : 0.0;
+    };
 
+    std::vector<std::vector<double>> restricted;
     for(a = 0; a < 2; a++) {
-        for(i = 0; i < SK.constraint.n; i++) {
-            ConstraintBase *c = &(SK.constraint.elem[i]);
-            if(c->group.v != g->h.v) continue;
+        for(hConstraint hc : SK.GetGroupItems(g->h)->constraint) {
+            ConstraintBase *c = SK.GetConstraint(hc);
             if((c->type == Constraint::Type::POINTS_COINCIDENT && a == 0) ||
                (c->type != Constraint::Type::POINTS_COINCIDENT && a == 1))
             {
@@ -375,23 +1468,39 @@ void System::FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad, bo
                 continue;
             }
 
-            param.ClearTags();
-            eq.Clear();
-            WriteEquationsExceptFor(c->h, g);
-            eq.ClearTags();
+            auto it = rowsOf.find(c->h.v);
+            if(it == rowsOf.end() || it->second.size() < (size_t)d) continue;
+            const std::vector<int> &rows = it->second;
 
-            // It's a major speedup to solve the easy ones by substitution here,
-            // and that doesn't break anything.
-            if(!forceDofCheck) {
-                SolveBySubstitution();
+            // Find the rank of the null space restricted to these rows, by
+            // elimination with partial pivoting.
+            int nr = (int)rows.size();
+            restricted.assign(nr, std::vector<double>(d));
+            for(j = 0; j < nr; j++) {
+                for(k = 0; k < d; k++) restricted[j][k] = valueAt(basis[k], rows[j]);
             }
-
-            WriteJacobian(0);
-            EvalJacobian();
-
-            int rank = CalculateRank();
-            if(rank == mat.m) {
-                // We fixed it by removing this constraint
+            int rank = 0;
+            for(k = 0; k < d && rank < nr; k++) {
+                int piv = -1;
+                double max = RANK_MAG_TOLERANCE;
+                for(j = rank; j < nr; j++) {
+                    if(ffabs(restricted[j][k]) > max) {
+                        max = ffabs(restricted[j][k]);
+                        piv = j;
+                    }
+                }
+                if(piv < 0) continue;
+                std::swap(restricted[piv], restricted[rank]);
+                for(j = rank + 1; j < nr; j++) {
+                    double f = restricted[j][k]/restricted[rank][k];
+                    for(int kk = k; kk < d; kk++) {
+                        restricted[j][kk] -= f*restricted[rank][kk];
+                    }
+                }
+                rank++;
+            }
+            if(rank == d) {
+                // We'd fix it by removing this constraint
                 bad->Add(&(c->h));
             }
         }
@@ -401,11 +1510,23 @@ void System::FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad, bo
 SolveResult System::Solve(Group *g, int *dof, List<hConstraint> *bad,
                           bool andFindBad, bool andFindFree, bool forceDofCheck)
 {
+    ExprTable::Scope scope(&exprs);
     WriteEquationsExceptFor(Constraint::NO_CONSTRAINT, g);
+    method = g->solveMethod;
 
     int i;
     bool rankOk;
 
+    // If we wrote just the same equations for this group last time, as we
+    // do while dragging, then we can reuse the Jacobians compiled from them.
+    std::vector<uint64_t> key;
+    WriteKey(forceDofCheck, &key);
+    Compiled *cache = &compiled[g->h.v];
+    if(cache->key != key) {
+        *cache = {};
+        cache->key = std::move(key);
+    }
+
 /*
     dbp("%d equations", eq.n);
     for(i = 0; i < eq.n; i++) {
@@ -424,52 +1545,41 @@ SolveResult System::Solve(Group *g, int *dof, List<hConstraint> *bad,
         SolveBySubstitution();
     }
 
-    // Before solving the big system, see if we can find any equations that
-    // are soluble alone. This can be a huge speedup. We don't know whether
-    // the system is consistent yet, but if it isn't then we'll catch that
-    // later.
-    int alone = 1;
-    for(i = 0; i < eq.n; i++) {
-        Equation *e = &(eq.elem[i]);
-        if(e->tag != 0) continue;
-
-        hParam hp = e->e->ReferencedParams(&param);
-        if(hp.v == Expr::NO_PARAMS.v) continue;
-        if(hp.v == Expr::MULTIPLE_PARAMS.v) continue;
-
-        Param *p = param.FindById(hp);
-        if(p->tag != 0) continue; // let rank test catch inconsistency
-
-        e->tag = alone;
-        p->tag = alone;
-        WriteJacobian(alone);
-        if(!NewtonSolve(alone)) {
+    // Before solving the big system, see if we can split off any blocks of
+    // equations that are soluble alone. This can be a huge speedup. A block
+    // that uses params that we haven't solved for yet, or that is singular
+    // here, stays in the big system; so does anything that depends on it.
+    // We don't know whether the system is consistent yet, but if it isn't
+    // then we'll catch that later.
+    {
+        std::vector<Block> blocks;
+        FindBlocks(&blocks);
+        if(!SolveBlocks(blocks, cache)) {
             // We don't do the rank test, so let's arbitrarily return
             // the DIDNT_CONVERGE result here.
             rankOk = true;
             // Failed to converge, bail out early
             goto didnt_converge;
         }
-        alone++;
     }
 
     // Now write the Jacobian for what's left, and do a rank test; that
     // tells us if the system is inconsistently constrained.
-    if(!WriteJacobian(0)) {
-        return SolveResult::TOO_MANY_UNKNOWNS;
-    }
-
-    rankOk = TestRank();
+    WriteJacobian(0, &cache->mat);
 
     // And do the leftovers as one big system
-    if(!NewtonSolve(0)) {
-        goto didnt_converge;
+    if(!mat.NewtonSolveFromLast()) {
+        rankOk = mat.TestRank();
+        if(!mat.NewtonSolve()) {
+            goto didnt_converge;
+        }
     }
 
-    rankOk = TestRank();
+    rankOk = mat.TestRank();
+    KeepJacobian(mat, &cache->mat);
     if(!rankOk) {
         if(!g->allowRedundant) {
-            if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad, forceDofCheck);
+            if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad);
         }
     } else {
         // This is not the full Jacobian, but any substitutions or single-eq
@@ -497,7 +1607,7 @@ SolveResult System::Solve(Group *g, int *dof, List<hConstraint> *bad,
 
 didnt_converge:
     SK.constraint.ClearTags();
-    for(i = 0; i < eq.n; i++) {
+    for(i = 0; i < mat.m; i++) {
         if(ffabs(mat.B.num[i]) > CONVERGE_TOLERANCE || isnan(mat.B.num[i])) {
             // This constraint is unsatisfied.
             if(!mat.eq[i].isFromConstraint()) continue;
@@ -520,6 +1630,7 @@ didnt_converge:
 SolveResult System::SolveRank(Group *g, int *dof, List<hConstraint> *bad,
                               bool andFindBad, bool andFindFree, bool forceDofCheck)
 {
+    ExprTable::Scope scope(&exprs);
     WriteEquationsExceptFor(Constraint::NO_CONSTRAINT, g);
 
     // All params and equations are assigned to group zero.
@@ -532,14 +1643,12 @@ SolveResult System::SolveRank(Group *g, int *dof, List<hConstraint> *bad,
 
     // Now write the Jacobian, and do a rank test; that
     // tells us if the system is inconsistently constrained.
-    if(!WriteJacobian(0)) {
-        return SolveResult::TOO_MANY_UNKNOWNS;
-    }
+    WriteJacobian(0);
 
-    bool rankOk = TestRank();
+    bool rankOk = mat.TestRank();
     if(!rankOk) {
         if(!g->allowRedundant) {
-            if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad, forceDofCheck);
+            if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad);
         }
     } else {
         // This is not the full Jacobian, but any substitutions or single-eq
@@ -551,33 +1660,45 @@ SolveResult System::SolveRank(Group *g, int *dof, List<hConstraint> *bad,
     return rankOk ? SolveResult::OKAY : SolveResult::REDUNDANT_OKAY;
 }
 
+//-----------------------------------------------------------------------------
+// Forget what we compiled to solve each group that's no longer in the sketch.
+//-----------------------------------------------------------------------------
+void System::ForgetRemovedGroups() {
+    for(auto it = compiled.begin(); it != compiled.end();) {
+        hGroup hg = { it->first };
+        if(SK.group.FindByIdNoOops(hg)) {
+            ++it;
+        } else {
+            it = compiled.erase(it);
+        }
+    }
+}
+
 void System::Clear() {
     entity.Clear();
     param.Clear();
     eq.Clear();
     dragged.Clear();
+    dimension.Clear();
+    compiled.clear();
 }
 
 void System::MarkParamsFree(bool find) {
     // If requested, find all the free (unbound) variables. This might be
     // more than the number of degrees of freedom. Don't always do this,
-    // because the display would get annoying and it's slow.
+    // because the display would get annoying. We've already got the
+    // Jacobian for the params that we solved for as one big system, so one
+    // more factorization tells us which of those are free.
     for(int i = 0; i < param.n; i++) {
-        Param *p = &(param.elem[i]);
-        p->free = false;
-
-        if(find) {
-            if(p->tag == 0) {
-                p->tag = VAR_DOF_TEST;
-                WriteJacobian(0);
-                EvalJacobian();
-                int rank = CalculateRank();
-                if(rank == mat.m) {
-                    p->free = true;
-                }
-                p->tag = 0;
-            }
-        }
+        param.elem[i].free = false;
+    }
+    if(!find) return;
+
+    std::vector<bool> free;
+    mat.EvalJacobian();
+    mat.CalculateRank(&free);
+    for(int j = 0; j < mat.n; j++) {
+        mat.parp[j]->free = free[j];
     }
 }
 
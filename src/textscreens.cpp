@@ -205,6 +205,11 @@ void TextWindow::ScreenChangeGroupOption(int link, uint32_t v) {
 
         case 'e': g->allowRedundant = !(g->allowRedundant); break;
 
+        case 'n':
+            g->solveMethod = (g->solveMethod == Group::SolveMethod::DAMPED) ?
+                Group::SolveMethod::NEWTON : Group::SolveMethod::DAMPED;
+            break;
+
         case 'v': g->visible = !(g->visible); break;
 
         case 'd': g->allDimsReference = !(g->allDimsReference); break;
@@ -403,6 +408,10 @@ void TextWindow::ShowGroupInfo() {
         &TextWindow::ScreenChangeGroupOption,
         g->allowRedundant ? CHECK_TRUE : CHECK_FALSE);
 
+    Printf(false, " %f%Ln%Fd%s  damp solver steps (for hard drags and edits)",
+        &TextWindow::ScreenChangeGroupOption,
+        g->solveMethod == Group::SolveMethod::DAMPED ? CHECK_TRUE : CHECK_FALSE);
+
     Printf(false, " %f%Ld%Fd%s  treat all dimensions as reference",
         &TextWindow::ScreenChangeGroupOption,
         g->allDimsReference ? CHECK_TRUE : CHECK_FALSE);
@@ -493,10 +502,6 @@ void TextWindow::ShowGroupSolveInfo() {
             Printf(true, "remove any one of these to fix it");
             break;
 
-        case SolveResult::TOO_MANY_UNKNOWNS:
-            Printf(true, "Too many unknowns in a single group!");
-            return;
-
         default: ssassert(false, "Unexpected solve result");
     }
 
@@ -26,6 +26,169 @@ std::string SolveSpace::ssprintf(const char *fmt, ...)
     return result;
 }
 
+//-----------------------------------------------------------------------------
+// A separate heap, on which we allocate expressions and other small stuff
+// that gets freed after every regeneration of the model. That saves us the
+// trouble of freeing it explicitly, and since it's freed all at once, it's
+// just an arena: we bump a pointer through big chunks, and keep the chunks
+// for next time. Allocations too big for that get their own block, so that
+// they can be freed one at a time. Each thread has its own arena, unless
+// it's given another. Something that makes a lot of temporaries that it
+// doesn't return can free just those by releasing back to a mark.
+//-----------------------------------------------------------------------------
+static const size_t TEMP_CHUNK_SIZE  = 1024*1024;
+static const size_t TEMP_CHUNKS_KEPT = 16;
+// Everything that we allocate here is made of doubles and pointers.
+static const size_t TEMP_ALIGN       = 8;
+
+static thread_local TemporaryArena ThreadArena;
+static thread_local TemporaryArena *CurrentArena = NULL;
+
+static TemporaryArena *Current() {
+    return CurrentArena ? CurrentArena : &ThreadArena;
+}
+
+TemporaryArena::Scope::Scope(TemporaryArena *arena) {
+    previous = CurrentArena;
+    CurrentArena = arena;
+}
+
+TemporaryArena::Scope::~Scope() {
+    CurrentArena = previous;
+}
+
+TemporaryArena::~TemporaryArena() {
+    FreeAll();
+    for(char *chunk : chunks) {
+        free(chunk);
+    }
+}
+
+void *TemporaryArena::Alloc(size_t n) {
+    n = std::max((n + TEMP_ALIGN - 1) & ~(TEMP_ALIGN - 1), TEMP_ALIGN);
+    if(n > TEMP_CHUNK_SIZE/4) {
+        void *p = calloc(1, n);
+        ssassert(p != NULL, "Cannot allocate memory");
+        largeIndex[p] = large.size();
+        large.push_back(p);
+        return p;
+    }
+
+    if(chunks.empty() || used + n > TEMP_CHUNK_SIZE) {
+        if(!chunks.empty()) current++;
+        if(current == chunks.size()) {
+            char *chunk = (char *)malloc(TEMP_CHUNK_SIZE);
+            ssassert(chunk != NULL, "Cannot allocate memory");
+            chunks.push_back(chunk);
+        }
+        used = 0;
+    }
+    void *p = chunks[current] + used;
+    used += n;
+    memset(p, 0, n);
+    return p;
+}
+
+void TemporaryArena::Free(void *p) {
+    // A small allocation is freed along with the rest of its chunk.
+    auto it = largeIndex.find(p);
+    if(it == largeIndex.end()) return;
+    large[it->second] = NULL;
+    largeIndex.erase(it);
+    free(p);
+}
+
+TemporaryMark TemporaryArena::Mark() const {
+    return { current, used, large.size() };
+}
+
+void TemporaryArena::Release(const TemporaryMark &mark) {
+    ssassert((mark.chunk < current || (mark.chunk == current && mark.used <= used)) &&
+             mark.large <= large.size(),
+             "Temporary heap was freed past a mark");
+    for(size_t i = mark.large; i < large.size(); i++) {
+        if(!large[i]) continue;
+        largeIndex.erase(large[i]);
+        free(large[i]);
+    }
+    large.resize(mark.large);
+    // The chunks after the mark's are kept, to be used again.
+    current = mark.chunk;
+    used    = mark.used;
+}
+
+void TemporaryArena::FreeAll() {
+    Release({ 0, 0, 0 });
+    // Keep some chunks for next time, but not so many that one big
+    // regeneration holds on to its peak.
+    for(size_t i = TEMP_CHUNKS_KEPT; i < chunks.size(); i++) {
+        free(chunks[i]);
+    }
+    if(chunks.size() > TEMP_CHUNKS_KEPT) {
+        chunks.resize(TEMP_CHUNKS_KEPT);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Take over everything allocated from another arena, so that it lives until
+// this one frees it; the chunks that the other arena had in use are freed
+// whole, like its big allocations. The other arena is left empty, but keeps
+// its spare chunks.
+//-----------------------------------------------------------------------------
+void TemporaryArena::Adopt(TemporaryArena *other) {
+    if(!other->chunks.empty()) {
+        size_t inUse = other->current + 1;
+        large.insert(large.end(), other->chunks.begin(),
+                     other->chunks.begin() + inUse);
+        other->chunks.erase(other->chunks.begin(), other->chunks.begin() + inUse);
+    }
+    for(void *p : other->large) {
+        if(!p) continue;
+        if(other->largeIndex.count(p)) largeIndex[p] = large.size();
+        large.push_back(p);
+    }
+
+    other->current = 0;
+    other->used    = 0;
+    other->large.clear();
+    other->largeIndex.clear();
+}
+
+void *SolveSpace::AllocTemporary(size_t n)
+{
+    return Current()->Alloc(n);
+}
+
+void SolveSpace::FreeTemporary(void *p)
+{
+    Current()->Free(p);
+}
+
+TemporaryMark SolveSpace::MarkTemporary()
+{
+    return Current()->Mark();
+}
+
+void SolveSpace::ReleaseTemporary(const TemporaryMark &mark)
+{
+    Current()->Release(mark);
+}
+
+void SolveSpace::AdoptTemporary(TemporaryArena *arena)
+{
+    Current()->Adopt(arena);
+}
+
+void SolveSpace::FreeAllTemporary()
+{
+    Current()->FreeAll();
+#if defined(WIN32)
+    // This is a good place to validate, because it gets called fairly
+    // often.
+    vl();
+#endif
+}
+
 char32_t utf8_iterator::operator*()
 {
     const uint8_t *it = (const uint8_t*) this->p;
@@ -92,6 +92,114 @@ TEST_CASE(precedence) {
   CHECK_TRUE(e->Eval() == 1);
 }
 
+TEST_CASE(tape) {
+  Expr *e, *f;
+  CHECK_PARSE(e, "sqrt(2) * (3 - 4 / 5) + sin(30)");
+  CHECK_PARSE(f, "acos(0) - square(3)");
+  ExprTape tape = {};
+  tape.Compile(e);
+  tape.Compile(f);
+  double v[2];
+  tape.Eval(v);
+  CHECK_EQ_EPS(v[0], e->Eval());
+  CHECK_EQ_EPS(v[1], f->Eval());
+}
+
+TEST_CASE(tape_gradient) {
+  ParamList params = {};
+  Param pa = {}, pb = {};
+  pa.h.v = 1;
+  pa.val = 0.3;
+  params.Add(&pa);
+  pb.h.v = 2;
+  pb.val = 1.7;
+  params.Add(&pb);
+
+  Expr *a = Expr::From(pa.h), *b = Expr::From(pb.h);
+  Expr *e = a->Times(b)->Plus(a->Sin())->Minus(b->Sqrt()->Div(a->Square()));
+  Expr *f = b->Cos()->Negate()->Plus(a->ASin()->Times(b));
+  ExprTape tape = {};
+  tape.CompileWithGradient(e->DeepCopyWithParamsAsPointers(&params, &params, &params));
+  tape.CompileWithGradient(f->DeepCopyWithParamsAsPointers(&params, &params, &params));
+  std::vector<double> grad(tape.gradParams.size());
+  double v[2];
+  tape.EvalWithGradient(v, grad.data());
+
+  Expr *eqs[2] = { e, f };
+  for(const ExprTape::Gradient &g : tape.gradients) {
+    for(int i = g.params; i < g.paramsEnd; i++) {
+      Expr *pd = eqs[g.output]->PartialWrt(tape.params[tape.gradParams[i]].second->h);
+      CHECK_EQ_EPS(grad[i], pd->DeepCopyWithParamsAsPointers(&params, &params, &params)->Eval());
+    }
+  }
+  CHECK_EQ_EPS(v[1], f->DeepCopyWithParamsAsPointers(&params, &params, &params)->Eval());
+  params.Clear();
+}
+
+TEST_CASE(jacobian_symbolic) {
+  // Whichever way the system differentiates, it gets the same Jacobian.
+  System sys = {};
+  double vals[] = { 0.3, 1.7, 0.9 };
+  for(int i = 0; i < 3; i++) {
+    Param p = {};
+    p.h.v = (uint32_t)(i + 1);
+    p.val = vals[i];
+    sys.param.Add(&p);
+  }
+  Expr *a = Expr::From(hParam { 1 }), *b = Expr::From(hParam { 2 }),
+       *c = Expr::From(hParam { 3 });
+  Expr *eqs[2] = {
+    a->Times(b)->Plus(c->Sin()),
+    a->Square()->Plus(b->Square())->Sqrt()->Minus(c->Div(b)),
+  };
+  for(int i = 0; i < 2; i++) {
+    Equation e = {};
+    e.h.v = (uint32_t)(i + 1);
+    e.e = eqs[i];
+    sys.eq.Add(&e);
+  }
+
+  double jacobian[2][2][3] = {};
+  System::Differentiation how[2] = {
+    System::Differentiation::AUTOMATIC, System::Differentiation::SYMBOLIC
+  };
+  for(int k = 0; k < 2; k++) {
+    sys.differentiation = how[k];
+    sys.WriteJacobian(0);
+    sys.mat.EvalJacobian();
+    for(int r = 0; r < sys.mat.m; r++) {
+      for(int j = sys.mat.A.row[r]; j < sys.mat.A.row[r + 1]; j++) {
+        jacobian[k][r][sys.mat.A.col[j]] = sys.mat.A.num[j];
+      }
+    }
+  }
+  for(int r = 0; r < 2; r++) {
+    for(int col = 0; col < 3; col++) {
+      CHECK_EQ_EPS(jacobian[0][r][col], jacobian[1][r][col]);
+    }
+  }
+  CHECK_EQ_EPS(jacobian[0][0][2], cos(0.9));
+  CHECK_EQ_EPS(jacobian[0][1][1], 1.7/sqrt(0.3*0.3 + 1.7*1.7) + 0.9/(1.7*1.7));
+  sys.Clear();
+}
+
+TEST_CASE(shared) {
+  ExprTable table = {};
+  ExprTable::Scope scope(&table);
+  Expr *a = Expr::From(hParam { 1 }), *b = Expr::From(hParam { 2 });
+  CHECK_TRUE(a->Times(b)->Sin() == Expr::From(hParam { 1 })->Times(b)->Sin());
+  CHECK_TRUE(a->Times(b) != b->Times(a));
+  Expr *e = a->Times(b)->Plus(b);
+  Expr *s = e->Substitute(hParam { 2 }, hParam { 3 });
+  CHECK_TRUE(e == a->Times(b)->Plus(b));
+  CHECK_TRUE(s == a->Times(Expr::From(hParam { 3 }))->Plus(Expr::From(hParam { 3 })));
+
+  std::unordered_map<uint32_t, hParam> subst = { { 1, hParam { 3 } }, { 2, hParam { 3 } } };
+  Expr *t = e->Substitute(subst);
+  Expr *c = Expr::From(hParam { 3 });
+  CHECK_TRUE(t == c->Times(c)->Plus(c));
+}
+
 TEST_CASE(errors) {
   CHECK_PARSE_ERR("\x01",
                   "Unexpected character");
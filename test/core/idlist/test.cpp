@@ -0,0 +1,85 @@
+#include "harness.h"
+
+struct hTestItem {
+    uint32_t v;
+};
+
+// Counts how many times it's been cleared, so that we can tell which of
+// several items with the same handle were dropped.
+struct TestItem {
+    hTestItem   h;
+    int         *cleared;
+
+    void Clear() { (*cleared)++; }
+};
+
+typedef IdList<TestItem, hTestItem> TestItemList;
+
+static void AppendItem(TestItemList *list, uint32_t v, int *cleared) {
+    TestItem t = {};
+    t.h.v     = v;
+    t.cleared = cleared;
+    list->Append(&t);
+}
+
+TEST_CASE(append_unsorted) {
+    int cleared[6] = {};
+    TestItemList list = {};
+    uint32_t order[] = { 5, 1, 4, 2, 3 };
+    for(uint32_t v : order) {
+        AppendItem(&list, v, &cleared[v]);
+    }
+    CHECK_TRUE(list.SortAppended());
+    CHECK_TRUE(list.n == 5);
+    for(int i = 0; i < list.n; i++) {
+        CHECK_TRUE(list.elem[i].h.v == (uint32_t)(i + 1));
+        CHECK_TRUE(list.elem[i].cleared == &cleared[i + 1]);
+    }
+    CHECK_TRUE(list.FindById({ 4 })->cleared == &cleared[4]);
+    CHECK_TRUE(list.FindByIdNoOops({ 6 }) == NULL);
+    for(int v = 1; v <= 5; v++) {
+        CHECK_TRUE(cleared[v] == 0);
+    }
+
+    // The list stays usable as a sorted list afterwards.
+    TestItem t = {};
+    t.h.v     = 0;
+    t.cleared = &cleared[0];
+    list.Add(&t);
+    CHECK_TRUE(list.n == 6);
+    CHECK_TRUE(list.elem[0].h.v == 0);
+    CHECK_TRUE(list.MaximumId() == 5);
+
+    list.Clear();
+    for(int v = 0; v <= 5; v++) {
+        CHECK_TRUE(cleared[v] == 1);
+    }
+}
+
+TEST_CASE(append_duplicates) {
+    // Items with the same handle are told apart by their counter.
+    int first3 = 0, second3 = 0, third3 = 0, first1 = 0, second1 = 0, only2 = 0;
+    TestItemList list = {};
+    AppendItem(&list, 3, &first3);
+    AppendItem(&list, 1, &first1);
+    AppendItem(&list, 3, &second3);
+    AppendItem(&list, 2, &only2);
+    AppendItem(&list, 1, &second1);
+    AppendItem(&list, 3, &third3);
+    CHECK_TRUE(!list.SortAppended());
+    CHECK_TRUE(list.n == 3);
+    CHECK_TRUE(list.elem[0].h.v == 1);
+    CHECK_TRUE(list.elem[1].h.v == 2);
+    CHECK_TRUE(list.elem[2].h.v == 3);
+
+    // The first added of each handle is kept, and the rest are cleared.
+    CHECK_TRUE(list.elem[0].cleared == &first1);
+    CHECK_TRUE(list.elem[1].cleared == &only2);
+    CHECK_TRUE(list.elem[2].cleared == &first3);
+    CHECK_TRUE(first1 == 0 && only2 == 0 && first3 == 0);
+    CHECK_TRUE(second1 == 1 && second3 == 1 && third3 == 1);
+
+    list.Clear();
+    CHECK_TRUE(first1 == 1 && only2 == 1 && first3 == 1);
+    CHECK_TRUE(second1 == 1 && second3 == 1 && third3 == 1);
+}
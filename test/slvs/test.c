@@ -0,0 +1,296 @@
+/*-----------------------------------------------------------------------------
+ * Tests for the library, through slvs.h just like any other caller; the main
+ * test suite can't cover this, since it links SolveSpace itself.
+ *---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <slvs.h>
+
+static unsigned checkCount, failCount;
+
+#define CHECK_TRUE(cond) \
+    do { \
+        checkCount++; \
+        if(!(cond)) { \
+            failCount++; \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return; \
+        } \
+    } while(0)
+#define CHECK_EQ_EPS(value, reference) \
+    CHECK_TRUE((value) - (reference) < 1e-6 && (reference) - (value) < 1e-6)
+
+/* A workplane in group 1, the xy plane, with a line along its x axis from
+ * its origin; and room for whatever a test wants to add in group 2. */
+static Slvs_System MakeSystem(int params, int entities, int constraints)
+{
+    Slvs_System sys;
+    memset(&sys, 0, sizeof(sys));
+    sys.param      = calloc(params + 9, sizeof(Slvs_Param));
+    sys.entity     = calloc(entities + 5, sizeof(Slvs_Entity));
+    sys.constraint = calloc(constraints, sizeof(Slvs_Constraint));
+
+    sys.param[sys.params++] = Slvs_MakeParam(1, 1, 0.0);
+    sys.param[sys.params++] = Slvs_MakeParam(2, 1, 0.0);
+    sys.param[sys.params++] = Slvs_MakeParam(3, 1, 0.0);
+    sys.entity[sys.entities++] = Slvs_MakePoint3d(101, 1, 1, 2, 3);
+    sys.param[sys.params++] = Slvs_MakeParam(4, 1, 1.0);
+    sys.param[sys.params++] = Slvs_MakeParam(5, 1, 0.0);
+    sys.param[sys.params++] = Slvs_MakeParam(6, 1, 0.0);
+    sys.param[sys.params++] = Slvs_MakeParam(7, 1, 0.0);
+    sys.entity[sys.entities++] = Slvs_MakeNormal3d(102, 1, 4, 5, 6, 7);
+    sys.entity[sys.entities++] = Slvs_MakeWorkplane(200, 1, 101, 102);
+
+    sys.param[sys.params++] = Slvs_MakeParam(8, 1, 10.0);
+    sys.param[sys.params++] = Slvs_MakeParam(9, 1, 0.0);
+    sys.entity[sys.entities++] = Slvs_MakePoint2d(301, 1, 200, 8, 9);
+    sys.entity[sys.entities++] = Slvs_MakeLineSegment(400, 1, 200, 101, 301);
+    return sys;
+}
+
+static void FreeSystem(Slvs_System *sys)
+{
+    free(sys->param);
+    free(sys->entity);
+    free(sys->constraint);
+    free(sys->failed);
+}
+
+/* A point in group 2 that must lie on the line, at a distance from the
+ * origin; its params are 1000+2*i and 1001+2*i. */
+static void AddPointOnLine(Slvs_System *sys, int i, double dist)
+{
+    Slvs_hParam hu = 1000 + 2*i, hv = 1001 + 2*i;
+    Slvs_hEntity he = 1000 + i;
+    sys->param[sys->params++] = Slvs_MakeParam(hu, 2, dist + 0.5);
+    sys->param[sys->params++] = Slvs_MakeParam(hv, 2, 0.3);
+    sys->entity[sys->entities++] = Slvs_MakePoint2d(he, 2, 200, hu, hv);
+    sys->constraint[sys->constraints++] = Slvs_MakeConstraint(
+        1000 + 2*i, 2, SLVS_C_PT_PT_DISTANCE, 200, dist, 101, he, 0, 0);
+    sys->constraint[sys->constraints++] = Slvs_MakeConstraint(
+        1001 + 2*i, 2, SLVS_C_PT_LINE_DISTANCE, 200, 0.0, he, 0, 400, 0);
+}
+
+/* Each point is a block of its own, and there are enough of them to be solved
+ * on several threads. */
+static void Test_many_blocks(void)
+{
+    enum { POINTS = 256 };
+    Slvs_System sys = MakeSystem(2*POINTS, POINTS, 2*POINTS);
+    int i;
+    for(i = 0; i < POINTS; i++) {
+        AddPointOnLine(&sys, i, 1.0 + i);
+    }
+
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_TRUE(sys.dof == 0);
+    for(i = 0; i < POINTS; i++) {
+        CHECK_EQ_EPS(sys.param[9 + 2*i].val, 1.0 + i);
+        CHECK_EQ_EPS(sys.param[9 + 2*i + 1].val, 0.0);
+    }
+    FreeSystem(&sys);
+}
+
+/* The caller's params can have any handles but the reserved ones, without
+ * getting mixed up with the params that the solver makes for dimensions. */
+static void Test_dimension_handles(void)
+{
+    Slvs_System sys = MakeSystem(3, 1, 2);
+    AddPointOnLine(&sys, 0, 3.0);
+    sys.param[sys.params++] = Slvs_MakeParam(1000 | 0x40000000, 2, 7.0);
+
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_EQ_EPS(sys.param[9].val, 3.0);
+
+    sys.param[11].h = 0xc0000000;
+    sys.param[9].val = 3.5;
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_INVALID);
+    CHECK_EQ_EPS(sys.param[9].val, 3.5);
+    FreeSystem(&sys);
+}
+
+/* The second solve compiles the same equations as the first, so it reuses
+ * them; but the dimension that they load has changed. */
+static void Test_dimension_changed(void)
+{
+    Slvs_System sys = MakeSystem(2, 1, 2);
+    AddPointOnLine(&sys, 0, 3.0);
+
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_EQ_EPS(sys.param[9].val, 3.0);
+
+    sys.constraint[0].valA = 5.0;
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_EQ_EPS(sys.param[9].val, 5.0);
+    CHECK_EQ_EPS(sys.param[10].val, 0.0);
+    FreeSystem(&sys);
+}
+
+static void Test_variants(void)
+{
+    enum { VARIANTS = 3 };
+    Slvs_System sys = MakeSystem(2, 1, 2);
+    AddPointOnLine(&sys, 0, 3.0);
+
+    double val[VARIANTS][11], valA[VARIANTS][2];
+    Slvs_Variant variant[VARIANTS];
+    int i, k;
+    for(k = 0; k < VARIANTS; k++) {
+        for(i = 0; i < sys.params; i++) val[k][i] = sys.param[i].val;
+        valA[k][0] = 1.0 + k;
+        valA[k][1] = 0.0;
+        memset(&variant[k], 0, sizeof(variant[k]));
+        variant[k].val  = val[k];
+        variant[k].valA = valA[k];
+    }
+
+    Slvs_SolveVariants(&sys, 2, variant, VARIANTS, 2);
+    for(k = 0; k < VARIANTS; k++) {
+        CHECK_TRUE(variant[k].result == SLVS_RESULT_OKAY);
+        CHECK_EQ_EPS(val[k][9], 1.0 + k);
+    }
+    CHECK_EQ_EPS(sys.param[9].val, 3.5);
+    FreeSystem(&sys);
+}
+
+/* Two constraints with the same handle, so nothing can be solved. */
+static void Test_invalid_system(void)
+{
+    enum { VARIANTS = 3 };
+    Slvs_System sys = MakeSystem(2, 1, 2);
+    AddPointOnLine(&sys, 0, 3.0);
+    sys.constraint[1].h = sys.constraint[0].h;
+
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_INVALID);
+    CHECK_TRUE(sys.faileds == 0);
+    CHECK_EQ_EPS(sys.param[9].val, 3.5);
+
+    double val[VARIANTS][11];
+    Slvs_Variant variant[VARIANTS];
+    int i, k;
+    for(k = 0; k < VARIANTS; k++) {
+        for(i = 0; i < sys.params; i++) val[k][i] = sys.param[i].val;
+        memset(&variant[k], 0, sizeof(variant[k]));
+        variant[k].val = val[k];
+    }
+
+    Slvs_SolveVariants(&sys, 2, variant, VARIANTS, 2);
+    for(k = 0; k < VARIANTS; k++) {
+        CHECK_TRUE(variant[k].result == SLVS_RESULT_INVALID);
+    }
+    FreeSystem(&sys);
+}
+
+static void Test_loaded(void)
+{
+    Slvs_System sys = MakeSystem(2, 1, 2);
+    AddPointOnLine(&sys, 0, 3.0);
+    Slvs_Context *ctx = Slvs_CreateContext();
+    double val;
+
+    CHECK_TRUE(Slvs_LoadSystem(ctx, &sys) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Slvs_SetParamValue(ctx, 1000, 4.0) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Slvs_SolveLoaded(ctx, &sys, 2) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_EQ_EPS(sys.param[9].val, 3.0);
+
+    /* Change the distance by taking its constraint out and putting it back
+     * with another value. */
+    CHECK_TRUE(Slvs_RemoveConstraint(ctx, 1000) == SLVS_RESULT_OKAY);
+    sys.constraint[0].valA = 6.0;
+    CHECK_TRUE(Slvs_AddConstraint(ctx, &sys.constraint[0]) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Slvs_SolveLoaded(ctx, &sys, 2) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Slvs_GetParamValue(ctx, 1000, &val) == SLVS_RESULT_OKAY);
+    CHECK_EQ_EPS(val, 6.0);
+
+    Slvs_DestroyContext(ctx);
+    FreeSystem(&sys);
+}
+
+/* Nothing that's wrong with the arguments changes what's loaded. */
+static void Test_loaded_invalid(void)
+{
+    Slvs_System sys = MakeSystem(3, 1, 2);
+    AddPointOnLine(&sys, 0, 3.0);
+    Slvs_Context *ctx = Slvs_CreateContext();
+    Slvs_Constraint bad;
+    double val = 0.0;
+
+    /* Nothing is loaded yet. */
+    CHECK_TRUE(Slvs_SolveLoaded(ctx, &sys, 2) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(sys.result == SLVS_RESULT_INVALID);
+    CHECK_TRUE(Slvs_AddConstraint(ctx, &sys.constraint[0]) == SLVS_RESULT_INVALID);
+
+    CHECK_TRUE(Slvs_LoadSystem(ctx, &sys) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Slvs_SetParamValue(ctx, 999, 1.0) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(Slvs_GetParamValue(ctx, 999, &val) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(val == 0.0);
+    CHECK_TRUE(Slvs_RemoveConstraint(ctx, 999) == SLVS_RESULT_INVALID);
+    /* Already loaded */
+    CHECK_TRUE(Slvs_AddConstraint(ctx, &sys.constraint[1]) == SLVS_RESULT_INVALID);
+    /* Of no type that we know */
+    bad = Slvs_MakeConstraint(2000, 2, 12345, 200, 0.0, 1000, 0, 0, 0);
+    CHECK_TRUE(Slvs_AddConstraint(ctx, &bad) == SLVS_RESULT_INVALID);
+
+    CHECK_TRUE(Slvs_SolveLoaded(ctx, &sys, 2) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_EQ_EPS(sys.param[9].val, 3.0);
+
+    /* A param to write back that isn't loaded */
+    sys.param[sys.params++] = Slvs_MakeParam(999, 2, 0.0);
+    CHECK_TRUE(Slvs_SolveLoaded(ctx, &sys, 2) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(sys.result == SLVS_RESULT_INVALID);
+    sys.params--;
+
+    /* And a system that can't be loaded leaves nothing loaded. */
+    sys.constraint[1].h = sys.constraint[0].h;
+    CHECK_TRUE(Slvs_LoadSystem(ctx, &sys) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(Slvs_GetParamValue(ctx, 1000, &val) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(Slvs_SolveLoaded(ctx, &sys, 2) == SLVS_RESULT_INVALID);
+
+    Slvs_DestroyContext(ctx);
+    FreeSystem(&sys);
+}
+
+static const struct {
+    const char  *name;
+    void       (*fn)(void);
+} TestCases[] = {
+    { "many_blocks",            Test_many_blocks },
+    { "dimension_changed",      Test_dimension_changed },
+    { "dimension_handles",      Test_dimension_handles },
+    { "variants",               Test_variants },
+    { "invalid_system",         Test_invalid_system },
+    { "loaded",                 Test_loaded },
+    { "loaded_invalid",         Test_loaded_invalid },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned i, ranTally = 0;
+    for(i = 0; i < sizeof(TestCases)/sizeof(TestCases[0]); i++) {
+        if(argc > 1 && !strstr(TestCases[i].name, argv[1])) continue;
+
+        unsigned failsBefore = failCount;
+        TestCases[i].fn();
+        ranTally++;
+        fprintf(stderr, "  %s   test slvs/%s\n",
+                (failCount > failsBefore) ? "NG" : "OK", TestCases[i].name);
+    }
+
+    if(failCount > 0) {
+        fprintf(stderr, "Failure! %u checks failed\n", failCount);
+    } else {
+        fprintf(stderr, "Success! %u test cases, %u checks\n", ranTally, checkCount);
+    }
+    return (failCount > 0);
+}